@@ -0,0 +1,129 @@
+#include <string.h>
+#include <errno.h>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+static const char CAPTURE_MAGIC[4] = {'P', 'M', 'P', 'C'};
+static const uint32_t CAPTURE_VERSION = 1;
+
+bool EventLoop::start_capture(const char *path) {
+    stop_capture();
+
+    FILE *out = fopen(path, "wb");
+
+    if (out == NULL) {
+        _trace("Failed to open capture file %s. %s", path, strerror(errno));
+
+        return false;
+    }
+
+    fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC), 1, out);
+    fwrite(&CAPTURE_VERSION, sizeof(CAPTURE_VERSION), 1, out);
+
+    capture_file = out;
+    capture_start_usec = now_usec();
+
+    _trace("Capturing traffic to %s", path);
+
+    return true;
+}
+
+void EventLoop::stop_capture() {
+    if (capture_file == NULL) {
+        return;
+    }
+
+    fclose(capture_file);
+
+    capture_file = NULL;
+
+    for (auto& s : server_state) {
+        for (auto& c : s.client_state) {
+            c.connection_id = 0;
+        }
+    }
+}
+
+/*
+* Appends a record for a captured client. Clients accepted before the
+* capture started have no connection id and are left out.
+*/
+void capture_record(EventLoop &loop, Client &c, uint8_t type, const char *buffer, uint32_t length) {
+    if (c.connection_id == 0) {
+        return;
+    }
+
+    CaptureRecord r;
+
+    r.usec = now_usec() - loop.capture_start_usec;
+    r.connection_id = c.connection_id;
+    r.type = type;
+    r.length = length;
+
+    FILE *out = loop.capture_file;
+
+    fwrite(&r.usec, sizeof(r.usec), 1, out);
+    fwrite(&r.connection_id, sizeof(r.connection_id), 1, out);
+    fwrite(&r.type, sizeof(r.type), 1, out);
+    fwrite(&r.length, sizeof(r.length), 1, out);
+
+    if (length > 0) {
+        fwrite(buffer, length, 1, out);
+    }
+}
+
+void capture_open(EventLoop &loop, Server &server, Client &c) {
+    //Known for every transport, unlike the address of the listener
+    uint32_t port = server.port;
+
+    c.connection_id = ++loop.next_connection_id;
+
+    capture_record(loop, c, CAPTURE_OPEN, (const char*) &port, sizeof(port));
+}
+
+FILE* open_capture(const char *path) {
+    FILE *in = fopen(path, "rb");
+
+    if (in == NULL) {
+        return NULL;
+    }
+
+    char magic[4];
+    uint32_t version;
+
+    if (fread(magic, sizeof(magic), 1, in) != 1 ||
+        fread(&version, sizeof(version), 1, in) != 1 ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+        version != CAPTURE_VERSION) {
+        fclose(in);
+
+        return NULL;
+    }
+
+    return in;
+}
+
+bool read_capture_record(FILE *in, CaptureRecord &record, std::vector<char> &payload) {
+    if (fread(&record.usec, sizeof(record.usec), 1, in) != 1 ||
+        fread(&record.connection_id, sizeof(record.connection_id), 1, in) != 1 ||
+        fread(&record.type, sizeof(record.type), 1, in) != 1 ||
+        fread(&record.length, sizeof(record.length), 1, in) != 1) {
+        return false;
+    }
+
+    payload.resize(record.length);
+
+    if (record.length > 0 && fread(payload.data(), record.length, 1, in) != 1) {
+        //Truncated, the server probably died mid write
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,522 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <deque>
+#include <vector>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+/*
+* One direction of a memory connection. Bytes are written at the
+* tail of a ring buffer and read from the head. When latency is
+* configured each write records the time its bytes become readable.
+*/
+struct MemoryPipe {
+    std::vector<char> ring;
+    size_t head;
+    size_t size; //Bytes in the ring
+    size_t visible; //Bytes in the ring that the reader can see
+    std::deque<std::pair<uint64_t, size_t>> releases; //Release time and byte count
+    bool reader_closed;
+    bool writer_closed;
+
+    MemoryPipe(size_t capacity) : ring(capacity) {
+        head = 0;
+        size = 0;
+        visible = 0;
+        reader_closed = false;
+        writer_closed = false;
+    }
+
+    //Makes bytes whose latency has expired visible. Returns the time
+    //the next bytes become visible or 0 if there are none.
+    uint64_t release(uint64_t now) {
+        while (!releases.empty() && releases.front().first <= now) {
+            visible += releases.front().second;
+            releases.pop_front();
+        }
+
+        return releases.empty() ? 0 : releases.front().first;
+    }
+};
+
+const int MEMORY_LISTENER = 1;
+const int MEMORY_CONNECTION = 2;
+
+struct MemoryEndpoint {
+    int kind;
+    int port; //For listeners
+    std::deque<int> backlog; //Connections waiting to be accepted
+    std::shared_ptr<MemoryPipe> in; //Bytes this endpoint reads
+    std::shared_ptr<MemoryPipe> out; //Bytes this endpoint writes
+
+    MemoryEndpoint(int k) {
+        kind = k;
+        port = 0;
+    }
+};
+
+/*
+* Reserves a descriptor number so that memory endpoints never
+* collide with real descriptors watched by the same loop.
+*/
+int reserve_fd() {
+    int fd = open("/dev/null", O_RDONLY);
+
+    if (fd >= FD_SETSIZE) {
+        ::close(fd);
+
+        errno = EMFILE;
+
+        return -1;
+    }
+
+    return fd;
+}
+
+MemoryTransport::MemoryTransport() {
+    buffer_size = 256 * 1024;
+    max_chunk = 0;
+    latency_usec = 0;
+    eagain_every = 0;
+
+    reads = 0;
+    writes = 0;
+    eagains_injected = 0;
+}
+
+MemoryTransport::~MemoryTransport() {
+    for (int fd = 0; fd < FD_SETSIZE; ++fd) {
+        if (endpoints[fd]) {
+            endpoints[fd].reset();
+            ::close(fd);
+        }
+    }
+}
+
+bool MemoryTransport::inject_eagain(uint64_t count) {
+    if (eagain_every <= 0) {
+        return false;
+    }
+
+    if (count % eagain_every != 0) {
+        return false;
+    }
+
+    ++eagains_injected;
+    errno = EAGAIN;
+
+    return true;
+}
+
+int MemoryTransport::listen(int port) {
+    for (auto& ep : endpoints) {
+        if (ep && ep->kind == MEMORY_LISTENER && ep->port == port) {
+            errno = EADDRINUSE;
+
+            return -1;
+        }
+    }
+
+    int fd = reserve_fd();
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    endpoints[fd] = std::make_shared<MemoryEndpoint>(MEMORY_LISTENER);
+    endpoints[fd]->port = port;
+
+    _trace("Memory listener %d at port: %d", fd, port);
+
+    return fd;
+}
+
+int MemoryTransport::accept(int listen_fd) {
+    auto& ep = endpoints[listen_fd];
+
+    if (!ep || ep->kind != MEMORY_LISTENER) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    if (ep->backlog.empty()) {
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    int fd = ep->backlog.front();
+
+    ep->backlog.pop_front();
+
+    return fd;
+}
+
+int MemoryTransport::connect(const struct sockaddr *addr, socklen_t addr_len) {
+    int port;
+
+    if (addr->sa_family == AF_INET) {
+        port = ntohs(((const struct sockaddr_in*) addr)->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        port = ntohs(((const struct sockaddr_in6*) addr)->sin6_port);
+    } else {
+        errno = EAFNOSUPPORT;
+
+        return -1;
+    }
+
+    std::shared_ptr<MemoryEndpoint> listener;
+
+    for (auto& ep : endpoints) {
+        if (ep && ep->kind == MEMORY_LISTENER && ep->port == port) {
+            listener = ep;
+
+            break;
+        }
+    }
+
+    if (!listener) {
+        errno = ECONNREFUSED;
+
+        return -1;
+    }
+
+    int client_fd = reserve_fd();
+
+    if (client_fd < 0) {
+        return -1;
+    }
+
+    int server_fd = reserve_fd();
+
+    if (server_fd < 0) {
+        ::close(client_fd);
+
+        return -1;
+    }
+
+    auto upstream = std::make_shared<MemoryPipe>(buffer_size);
+    auto downstream = std::make_shared<MemoryPipe>(buffer_size);
+
+    auto client = std::make_shared<MemoryEndpoint>(MEMORY_CONNECTION);
+
+    client->out = upstream;
+    client->in = downstream;
+
+    auto server = std::make_shared<MemoryEndpoint>(MEMORY_CONNECTION);
+
+    server->out = downstream;
+    server->in = upstream;
+
+    endpoints[client_fd] = client;
+    endpoints[server_fd] = server;
+
+    listener->backlog.push_back(server_fd);
+
+    return client_fd;
+}
+
+int MemoryTransport::connect_error(int fd) {
+    //Memory connections are established immediately
+    return 0;
+}
+
+ssize_t MemoryTransport::read(int fd, void *buffer, size_t length) {
+    auto& ep = endpoints[fd];
+
+    if (!ep) {
+        return ::read(fd, buffer, length);
+    }
+
+    ++reads;
+
+    if (ep->kind != MEMORY_CONNECTION) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    if (inject_eagain(reads)) {
+        return -1;
+    }
+
+    MemoryPipe &pipe = *ep->in;
+
+    if (latency_usec > 0) {
+        pipe.release(now_usec());
+    }
+
+    if (pipe.visible == 0) {
+        if (pipe.writer_closed && pipe.size == 0) {
+            //End of stream
+            return 0;
+        }
+
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    size_t n = length < pipe.visible ? length : pipe.visible;
+
+    if (max_chunk > 0 && n > max_chunk) {
+        n = max_chunk;
+    }
+
+    size_t capacity = pipe.ring.size();
+    size_t first = capacity - pipe.head;
+
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(buffer, pipe.ring.data() + pipe.head, first);
+    memcpy((char*) buffer + first, pipe.ring.data(), n - first);
+
+    pipe.head = (pipe.head + n) % capacity;
+    pipe.size -= n;
+    pipe.visible -= n;
+
+    return n;
+}
+
+ssize_t MemoryTransport::write(int fd, const void *buffer, size_t length) {
+    auto& ep = endpoints[fd];
+
+    if (!ep) {
+        return ::write(fd, buffer, length);
+    }
+
+    ++writes;
+
+    if (ep->kind != MEMORY_CONNECTION) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    if (inject_eagain(writes)) {
+        return -1;
+    }
+
+    MemoryPipe &pipe = *ep->out;
+
+    if (pipe.reader_closed) {
+        errno = EPIPE;
+
+        return -1;
+    }
+
+    size_t capacity = pipe.ring.size();
+    size_t room = capacity - pipe.size;
+
+    if (room == 0) {
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    size_t n = length < room ? length : room;
+
+    if (max_chunk > 0 && n > max_chunk) {
+        n = max_chunk;
+    }
+
+    size_t tail = (pipe.head + pipe.size) % capacity;
+    size_t first = capacity - tail;
+
+    if (first > n) {
+        first = n;
+    }
+
+    memcpy(pipe.ring.data() + tail, buffer, first);
+    memcpy(pipe.ring.data(), (const char*) buffer + first, n - first);
+
+    pipe.size += n;
+
+    if (latency_usec > 0) {
+        pipe.releases.push_back(std::make_pair(now_usec() + latency_usec, n));
+    } else {
+        pipe.visible += n;
+    }
+
+    return n;
+}
+
+int MemoryTransport::shutdown_write(int fd) {
+    auto& ep = endpoints[fd];
+
+    if (!ep) {
+        return ::shutdown(fd, SHUT_WR);
+    }
+
+    if (ep->kind != MEMORY_CONNECTION) {
+        errno = ENOTCONN;
+
+        return -1;
+    }
+
+    ep->out->writer_closed = true;
+
+    return 0;
+}
+
+void MemoryTransport::close(int fd) {
+    auto ep = endpoints[fd];
+
+    if (!ep) {
+        ::close(fd);
+
+        return;
+    }
+
+    endpoints[fd].reset();
+
+    if (ep->kind == MEMORY_LISTENER) {
+        //Refuse connections that were never accepted
+        for (int pending : ep->backlog) {
+            close(pending);
+        }
+    } else {
+        ep->in->reader_closed = true;
+        ep->out->writer_closed = true;
+    }
+
+    ::close(fd);
+}
+
+int MemoryTransport::select(int nfds, fd_set *read_fd_set, fd_set *write_fd_set, struct timeval *timeout) {
+    fd_set real_read_fd_set, real_write_fd_set;
+    fd_set ready_read_fd_set, ready_write_fd_set;
+    int real_nfds = 0;
+    int num_ready = 0;
+    uint64_t now = now_usec();
+    uint64_t next_release = 0;
+
+    FD_ZERO(&real_read_fd_set);
+    FD_ZERO(&real_write_fd_set);
+    FD_ZERO(&ready_read_fd_set);
+    FD_ZERO(&ready_write_fd_set);
+
+    for (int fd = 0; fd < nfds; ++fd) {
+        bool want_read = read_fd_set != NULL && FD_ISSET(fd, read_fd_set);
+        bool want_write = write_fd_set != NULL && FD_ISSET(fd, write_fd_set);
+
+        if (!want_read && !want_write) {
+            continue;
+        }
+
+        auto& ep = endpoints[fd];
+
+        if (!ep) {
+            //A real descriptor. Let the kernel poll it.
+            if (want_read) {
+                FD_SET(fd, &real_read_fd_set);
+            }
+            if (want_write) {
+                FD_SET(fd, &real_write_fd_set);
+            }
+
+            real_nfds = fd + 1;
+
+            continue;
+        }
+
+        if (ep->kind == MEMORY_LISTENER) {
+            if (want_read && !ep->backlog.empty()) {
+                FD_SET(fd, &ready_read_fd_set);
+                ++num_ready;
+            }
+
+            continue;
+        }
+
+        if (want_read) {
+            MemoryPipe &in = *ep->in;
+            uint64_t release = latency_usec > 0 ? in.release(now) : 0;
+
+            if (release > 0 && (next_release == 0 || release < next_release)) {
+                next_release = release;
+            }
+
+            if (in.visible > 0 || (in.writer_closed && in.size == 0)) {
+                FD_SET(fd, &ready_read_fd_set);
+                ++num_ready;
+            }
+        }
+
+        if (want_write) {
+            MemoryPipe &out = *ep->out;
+
+            if (out.reader_closed || out.size < out.ring.size()) {
+                FD_SET(fd, &ready_write_fd_set);
+                ++num_ready;
+            }
+        }
+    }
+
+    if (real_nfds > 0 || (num_ready == 0 && (timeout != NULL || next_release > 0))) {
+        //Wait for real descriptors, the next latency release or the timeout.
+        //Don't wait at all if memory descriptors are already ready.
+        struct timeval wait;
+        struct timeval *wait_ptr = timeout;
+        bool wait_for_release = false;
+
+        if (num_ready > 0) {
+            wait.tv_sec = 0;
+            wait.tv_usec = 0;
+            wait_ptr = &wait;
+        } else if (next_release > 0) {
+            uint64_t wait_usec = next_release > now ? next_release - now : 0;
+
+            if (timeout == NULL || (uint64_t) timeout->tv_sec * 1000000 + timeout->tv_usec > wait_usec) {
+                wait.tv_sec = wait_usec / 1000000;
+                wait.tv_usec = wait_usec % 1000000;
+                wait_ptr = &wait;
+                wait_for_release = true;
+            }
+        }
+
+        int status = ::select(real_nfds, &real_read_fd_set, &real_write_fd_set, NULL, wait_ptr);
+
+        if (status < 0) {
+            return status;
+        }
+
+        for (int fd = 0; fd < real_nfds; ++fd) {
+            if (FD_ISSET(fd, &real_read_fd_set)) {
+                FD_SET(fd, &ready_read_fd_set);
+                ++num_ready;
+            }
+            if (FD_ISSET(fd, &real_write_fd_set)) {
+                FD_SET(fd, &ready_write_fd_set);
+                ++num_ready;
+            }
+        }
+
+        if (num_ready == 0 && wait_for_release) {
+            //Latency expired. Check the memory descriptors again.
+            return select(nfds, read_fd_set, write_fd_set, timeout);
+        }
+    }
+
+    if (read_fd_set != NULL) {
+        *read_fd_set = ready_read_fd_set;
+    }
+    if (write_fd_set != NULL) {
+        *write_fd_set = ready_write_fd_set;
+    }
+
+    return num_ready;
+}
+
+}
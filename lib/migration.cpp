@@ -0,0 +1,421 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <chrono>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+void wake_for_migration(EventLoop &loop) {
+    char ch = 0;
+
+    if (write(loop.migration_pipe[1], &ch, 1) < 0) {
+        //Full. The loop is already awake.
+    }
+}
+
+//Adopts migrated clients when another loop writes to the pipe
+struct MigrationWatcher : public WatchEventHandler {
+    void on_readable(EventLoop &loop, int fd) {
+        char buff[64];
+
+        while (read(fd, buff, sizeof(buff)) > 0) {
+        }
+
+        loop.adopt_migrated_clients();
+    }
+};
+
+/*
+* Called by the constructor. The pipe stays open until the
+* destructor, so other threads never write to a closed fd.
+*/
+void open_migration_channel(EventLoop &loop) {
+    if (pipe(loop.migration_pipe) < 0) {
+        _trace("Failed to create migration pipe. %s", strerror(errno));
+
+        return;
+    }
+
+    for (int fd : loop.migration_pipe) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    loop.watch(loop.migration_pipe[0], RW_STATE_READ, std::make_shared<MigrationWatcher>());
+}
+
+void close_migration_channel(EventLoop &loop) {
+    ClientHandoff h;
+
+    //Nobody will adopt these any more
+    while (loop.migration_queue.pop(h)) {
+        loop.transport->close(h.fd);
+    }
+
+    if (loop.migration_pipe[0] >= 0) {
+        loop.unwatch(loop.migration_pipe[0]);
+
+        close(loop.migration_pipe[0]);
+        close(loop.migration_pipe[1]);
+
+        loop.migration_pipe[0] = -1;
+        loop.migration_pipe[1] = -1;
+    }
+}
+
+//Publishes the load figures read by the Rebalancer and migrate()
+void publish_load(EventLoop &loop) {
+    uint32_t clients = 0;
+
+    for (int i = 0; i < MAX_SERVERS; ++i) {
+        auto& s = loop.server_state[i];
+        int used = 0;
+
+        for (auto& p : s.poll_state) {
+            used += p.fd >= 0;
+        }
+
+        clients += used;
+        loop.published_free[i].store(s.in_use() ? MAX_CLIENTS - used : 0, std::memory_order_relaxed);
+    }
+
+    int outbound = 0;
+
+    for (auto& p : loop.client_poll_state) {
+        outbound += p.fd >= 0;
+    }
+
+    clients += outbound;
+    loop.published_free[MAX_SERVERS].store(MAX_CLIENTS - outbound, std::memory_order_relaxed);
+
+    loop.published_idle_usec.store(loop.stats.spin_usec + loop.stats.sleep_usec, std::memory_order_relaxed);
+    loop.published_clients.store(clients, std::memory_order_relaxed);
+}
+
+bool EventLoop::migrate(Client &c, EventLoop &dest) {
+    if (&dest == this || !c.in_use() || !c.is_connected || c.relay || c.zerocopy_pending() || c.tls ||
+        (c.limit && c.limit->throttled_until > 0)) {
+        return false;
+    }
+
+    if (c.handler.block != NULL) {
+        //Freeing it on the other thread would corrupt our pool
+        return false;
+    }
+
+    ClientHandoff h;
+    Server *s = find_server(c);
+
+    h.server_index = s != NULL ? s - server_state : -1;
+
+    int k = s != NULL ? h.server_index : MAX_SERVERS;
+
+    //Claim one of the free slots the other loop published
+    if (dest.migrations_queued[k].fetch_add(1) >= dest.published_free[k].load(std::memory_order_relaxed)) {
+        dest.migrations_queued[k].fetch_sub(1);
+
+        return false;
+    }
+
+    h.fd = c.fd;
+    h.read_write_flag = c.read_write_flag;
+    h.read_buffer = c.read_buffer;
+    h.read_length = c.read_length;
+    h.read_completed = c.read_completed;
+    h.write_buffer = c.write_buffer;
+    h.write_length = c.write_length;
+    h.write_completed = c.write_completed;
+    h.write_owner = c.write_owner;
+    h.stream = std::move(c.stream);
+    h.limit = std::move(c.limit);
+    h.handler = c.handler.shared;
+    h.zerocopy_threshold = c.zerocopy_threshold;
+    h.host[0] = '\0';
+    h.port = 0;
+    h.source = this;
+
+    if (s == NULL) {
+        ClientInfo &info = client_info[&c - client_state];
+
+        memcpy(h.host, info.host, sizeof(h.host));
+        h.port = info.port;
+    }
+
+    if (!dest.migration_queue.push(std::move(h))) {
+        _trace("Migration queue is full.");
+
+        dest.migrations_queued[k].fetch_sub(1);
+        c.stream = std::move(h.stream);
+        c.limit = std::move(h.limit);
+
+        return false;
+    }
+
+    _trace("Migrated client: %d", c.fd);
+
+    //The fd belongs to the other loop now. Free the slot without closing it.
+    c.reset();
+
+    wake_for_migration(dest);
+
+    return true;
+}
+
+//Hands a client we have no room for back to the loop it came from
+bool return_handoff(EventLoop &loop, ClientHandoff &h) {
+    EventLoop *source = h.source;
+
+    if (source == NULL || source == &loop) {
+        return false;
+    }
+
+    int k = h.server_index >= 0 ? h.server_index : MAX_SERVERS;
+    int fd = h.fd;
+
+    //It stays there even if the slot is gone
+    h.source = NULL;
+
+    source->migrations_queued[k].fetch_add(1);
+
+    if (!source->migration_queue.push(std::move(h))) {
+        source->migrations_queued[k].fetch_sub(1);
+
+        return false;
+    }
+
+    _trace("No room for migrated client: %d. Sending it back...", fd);
+
+    wake_for_migration(*source);
+
+    return true;
+}
+
+//Disconnects a client neither loop has room for
+void drop_handoff(EventLoop &loop, ClientHandoff &h) {
+    _trace("No room for migrated client: %d. Disconnecting...", h.fd);
+
+    //A slot of its own for the callback
+    Client c;
+
+    c.set_fd(h.fd);
+    c.set_connected(true);
+    c.handler = std::move(h.handler);
+
+    if (h.server_index >= 0) {
+        Server &s = loop.server_state[h.server_index];
+
+        if (s.in_use() && s.handler) {
+            s.handler->on_client_disconnect(s, c);
+        }
+    } else if (c.handler) {
+        c.handler->on_server_disconnect(c);
+    }
+
+    loop.transport->close(h.fd);
+    c.reset();
+    h.write_owner.reset();
+    h.stream.reset();
+    h.limit.reset();
+}
+
+void EventLoop::adopt_migrated_clients() {
+    ClientHandoff h;
+
+    while (migration_queue.pop(h)) {
+        int k = h.server_index >= 0 ? h.server_index : MAX_SERVERS;
+        Client *c = NULL;
+
+        migrations_queued[k].fetch_sub(1);
+
+        if (h.server_index >= 0) {
+            Server &s = server_state[h.server_index];
+
+            for (auto& slot : s.client_state) {
+                if (s.in_use() && !slot.in_use()) {
+                    c = &slot;
+
+                    break;
+                }
+            }
+        } else {
+            for (int i = 0; i < MAX_CLIENTS; ++i) {
+                if (!client_state[i].in_use()) {
+                    c = &client_state[i];
+
+                    client_info[i].reset();
+                    memcpy(client_info[i].host, h.host, sizeof(h.host));
+                    client_info[i].port = h.port;
+
+                    break;
+                }
+            }
+        }
+
+        if (c == NULL) {
+            if (!return_handoff(*this, h)) {
+                drop_handoff(*this, h);
+            }
+
+            continue;
+        }
+
+        //Until the next publish_load()
+        published_free[k].fetch_sub(1, std::memory_order_relaxed);
+
+        c->reset();
+        c->set_fd(h.fd);
+        c->set_connected(true);
+        c->set_read_write_flag(h.read_write_flag);
+        c->read_buffer = h.read_buffer;
+        c->read_length = h.read_length;
+        c->read_completed = h.read_completed;
+        c->write_buffer = h.write_buffer;
+        c->write_length = h.write_length;
+        c->write_completed = h.write_completed;
+        c->write_owner = std::move(h.write_owner);
+        c->stream = std::move(h.stream);
+        c->limit = std::move(h.limit);
+        c->handler = std::move(h.handler);
+        c->zerocopy_threshold = h.zerocopy_threshold;
+        c->sync_poll_slot();
+
+        _trace("Adopted client: %d", c->fd);
+    }
+}
+
+void EventLoop::shed_clients() {
+    int count = shed_count.exchange(0);
+    EventLoop *target = shed_target.load();
+
+    if (count <= 0 || target == NULL) {
+        return;
+    }
+
+    for (auto& s : server_state) {
+        for (auto& c : s.client_state) {
+            if (count == 0) {
+                return;
+            }
+
+            if (c.in_use() && migrate(c, *target)) {
+                --count;
+            }
+        }
+    }
+}
+
+//Idle time of a loop including the select() it is blocked in
+uint64_t idle_usec(EventLoop &loop, uint64_t now) {
+    uint64_t sleep_start = loop.published_sleep_start.load(std::memory_order_relaxed);
+    uint64_t idle = loop.published_idle_usec.load(std::memory_order_relaxed);
+
+    if (sleep_start > 0 && now > sleep_start) {
+        idle += now - sleep_start;
+    }
+
+    return idle;
+}
+
+Rebalancer::Rebalancer() {
+    interval_ms = 1000;
+    threshold = 0.25;
+    max_moves = 8;
+    running = false;
+}
+
+Rebalancer::~Rebalancer() {
+    stop();
+}
+
+void Rebalancer::add_loop(EventLoop &loop) {
+    loops.push_back(&loop);
+}
+
+void Rebalancer::start() {
+    if (running) {
+        return;
+    }
+
+    running = true;
+    thread = std::thread(&Rebalancer::run, this);
+}
+
+void Rebalancer::stop() {
+    running = false;
+
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Rebalancer::run() {
+    size_t n = loops.size();
+    std::vector<uint64_t> last_idle(n);
+    std::vector<double> utilization(n);
+    uint64_t last = now_usec();
+
+    for (size_t i = 0; i < n; ++i) {
+        last_idle[i] = idle_usec(*loops[i], last);
+    }
+
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+
+        uint64_t now = now_usec();
+        uint64_t elapsed = now - last;
+
+        last = now;
+
+        if (elapsed == 0) {
+            continue;
+        }
+
+        int busiest = -1, idlest = -1;
+
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t idle = idle_usec(*loops[i], now);
+            double idle_ratio = idle > last_idle[i] ? (double) (idle - last_idle[i]) / elapsed : 0.0;
+
+            last_idle[i] = idle;
+            utilization[i] = idle_ratio > 1.0 ? 0.0 : 1.0 - idle_ratio;
+
+            if (busiest < 0 || utilization[i] > utilization[busiest]) {
+                busiest = i;
+            }
+            if (idlest < 0 || utilization[i] < utilization[idlest]) {
+                idlest = i;
+            }
+        }
+
+        if (busiest < 0 || busiest == idlest ||
+            utilization[busiest] - utilization[idlest] < threshold) {
+            continue;
+        }
+
+        int from = loops[busiest]->published_clients.load(std::memory_order_relaxed);
+        int to = loops[idlest]->published_clients.load(std::memory_order_relaxed);
+        int moves = (from - to) / 2;
+
+        if (moves <= 0) {
+            //Moving clients wouldn't even out the work
+            continue;
+        }
+
+        if (moves > max_moves) {
+            moves = max_moves;
+        }
+
+        _trace("Rebalancing %d clients. Utilization %.2f vs %.2f", moves, utilization[busiest], utilization[idlest]);
+
+        loops[busiest]->shed_target.store(loops[idlest]);
+        loops[busiest]->shed_count.store(moves);
+    }
+}
+
+}
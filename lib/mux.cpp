@@ -0,0 +1,239 @@
+#include <string.h>
+#include <netinet/in.h>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+MuxChannel::MuxChannel(EventLoop &l, std::shared_ptr<MuxEventHandler> h, size_t max) : loop(l), handler(h) {
+    client = NULL;
+    connecting = false;
+    max_frame = max;
+    next_id = 1;
+    timer_id = -1;
+    timer_deadline = 0;
+}
+
+bool MuxChannel::connect(const char *host, int port, int connect_timeout, std::shared_ptr<TlsContext> tls) {
+    if (client != NULL || connecting) {
+        return false;
+    }
+
+    connecting = loop.add_client(host, port, shared_from_this(), connect_timeout, tls) != NULL;
+
+    return connecting;
+}
+
+void MuxChannel::close() {
+    if (client != NULL) {
+        loop.disconnect_client(*client);
+    }
+}
+
+uint32_t MuxChannel::send(const char *payload, size_t length, uint64_t timeout_usec) {
+    if ((client == NULL && !connecting) || length > UINT32_MAX) {
+        return 0;
+    }
+
+    uint32_t id;
+
+    //0 means failure. After a wrap, skip ids still waiting.
+    do {
+        id = next_id++;
+    } while (id == 0 || pending.count(id) > 0);
+
+    uint32_t header[2] = {htonl((uint32_t) length), htonl(id)};
+
+    outgoing.append((const char*) header, MUX_HEADER_SIZE);
+    outgoing.append(payload, length);
+
+    if (timeout_usec > 0) {
+        pending[id] = deadlines.emplace(now_usec() + timeout_usec, id);
+
+        arm_timer();
+    } else {
+        pending[id] = deadlines.end();
+    }
+
+    flush();
+
+    return id;
+}
+
+bool MuxChannel::cancel(uint32_t id) {
+    auto it = pending.find(id);
+
+    if (it == pending.end()) {
+        return false;
+    }
+
+    if (it->second != deadlines.end()) {
+        deadlines.erase(it->second);
+    }
+
+    pending.erase(it);
+
+    return true;
+}
+
+//Hands the queued frames to the loop unless it is still writing
+void MuxChannel::flush() {
+    if (client == NULL || outgoing.empty() || (client->read_write_flag & RW_STATE_WRITE)) {
+        return;
+    }
+
+    writing.swap(outgoing);
+    outgoing.clear();
+
+    client->schedule_write(writing.data(), writing.size());
+}
+
+//Keeps one timer for the earliest deadline
+void MuxChannel::arm_timer() {
+    if (deadlines.empty()) {
+        loop.cancel_timer(timer_id);
+        timer_id = -1;
+
+        return;
+    }
+
+    uint64_t deadline = deadlines.begin()->first;
+
+    if (timer_id >= 0 && timer_deadline == deadline) {
+        return;
+    }
+
+    loop.cancel_timer(timer_id);
+
+    uint64_t now = now_usec();
+
+    timer_deadline = deadline;
+    timer_id = loop.add_timer(deadline > now ? deadline - now : 0, shared_from_this());
+
+    if (timer_id < 0) {
+        _trace("No timer left for request timeouts.");
+    }
+}
+
+void MuxChannel::fail_pending() {
+    std::vector<uint32_t> ids;
+
+    for (auto& p : pending) {
+        ids.push_back(p.first);
+    }
+
+    pending.clear();
+    deadlines.clear();
+    outgoing.clear();
+    writing.clear();
+
+    loop.cancel_timer(timer_id);
+    timer_id = -1;
+
+    for (uint32_t id : ids) {
+        handler->on_error(*this, id);
+    }
+}
+
+void MuxChannel::on_server_connect(Client &c) {
+    client = &c;
+    connecting = false;
+
+    //A response may be as long as max_frame
+    if (!c.start_stream(16 * 1024, max_frame + MUX_HEADER_SIZE)) {
+        loop.disconnect_client(c);
+
+        return;
+    }
+
+    handler->on_connect(*this);
+
+    flush();
+}
+
+void MuxChannel::on_server_connect_failed(Client &c) {
+    connecting = false;
+
+    fail_pending();
+
+    handler->on_disconnect(*this);
+}
+
+void MuxChannel::on_server_disconnect(Client &c) {
+    client = NULL;
+    connecting = false;
+
+    fail_pending();
+
+    handler->on_disconnect(*this);
+}
+
+void MuxChannel::on_read(Client &c, const char *buffer, int bytes_read) {
+    //The handler may drop the last reference
+    auto self = shared_from_this();
+
+    while (client != NULL && c.stream_size() >= MUX_HEADER_SIZE) {
+        const char *frame = c.stream_data();
+        uint32_t header[2];
+
+        memcpy(header, frame, MUX_HEADER_SIZE);
+
+        size_t length = ntohl(header[0]);
+        uint32_t id = ntohl(header[1]);
+
+        if (length > max_frame) {
+            _trace("Response of %lu bytes is longer than the limit: %lu", length, max_frame);
+
+            loop.disconnect_client(c);
+
+            return;
+        }
+
+        if (c.stream_size() < MUX_HEADER_SIZE + length) {
+            //Wait for the rest
+            break;
+        }
+
+        if (cancel(id)) {
+            handler->on_response(*this, id, frame + MUX_HEADER_SIZE, length);
+        } else {
+            _trace("Dropping response to unknown request: %u", id);
+        }
+
+        if (client == NULL) {
+            //Closed by the handler
+            return;
+        }
+
+        c.consume(MUX_HEADER_SIZE + length);
+    }
+
+    arm_timer();
+}
+
+void MuxChannel::on_write_completed(Client &c) {
+    writing.clear();
+
+    flush();
+}
+
+void MuxChannel::on_timer(EventLoop &l, int id) {
+    timer_id = -1;
+
+    uint64_t now = now_usec();
+
+    while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        uint32_t request = deadlines.begin()->second;
+
+        cancel(request);
+
+        handler->on_timeout(*this, request);
+    }
+
+    arm_timer();
+}
+
+}
@@ -10,6 +10,16 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+#include <typeinfo>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <linux/errqueue.h>
+#endif
 
 #include "pompeii.h"
 
@@ -17,6 +27,29 @@
 
 namespace pompeii {
 
+//Defined in watchdog.cpp
+uint64_t begin_callback(EventLoop &loop, const char *handler_type, const char *callback, int fd);
+void end_callback(EventLoop &loop, const char *handler_type, const char *callback, int fd, uint64_t start);
+
+/*
+* Calls a handler. With slow callback tracking or the watchdog
+* on, the call is timed and the loop publishes which callback
+* it is in. The handler may be gone by the time the call returns.
+*/
+#define CALL_HANDLER(loop, h, callback, fd, ...) \
+    do { \
+        EventLoop *_loop = (loop); \
+        if (_loop != NULL && _loop->callback_timing) { \
+            const char *_type = typeid(*(h)).name(); \
+            int _fd = (fd); \
+            uint64_t _start = begin_callback(*_loop, _type, #callback, _fd); \
+            (h)->callback(__VA_ARGS__); \
+            end_callback(*_loop, _type, #callback, _fd, _start); \
+        } else { \
+            (h)->callback(__VA_ARGS__); \
+        } \
+    } while (0)
+
 static int trace_on = 0;
 
 void
@@ -39,7 +72,102 @@ enable_trace(int flag) {
     trace_on = flag;
 }
 
+uint64_t now_usec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+LoopStats::LoopStats() {
+    reset();
+}
+
+void LoopStats::reset() {
+    spin_polls = 0;
+    spin_wakeups = 0;
+    spin_usec = 0;
+    sleep_polls = 0;
+    sleep_wakeups = 0;
+    sleep_usec = 0;
+    throttle_count = 0;
+    throttled_usec = 0;
+}
+
+double LoopStats::spin_wakeup_ratio() {
+    uint64_t wakeups = spin_wakeups + sleep_wakeups;
+
+    return wakeups == 0 ? 0.0 : (double) spin_wakeups / wakeups;
+}
+
+double LoopStats::spin_time_ratio() {
+    uint64_t total = spin_usec + sleep_usec;
+
+    return total == 0 ? 0.0 : (double) spin_usec / total;
+}
+
+void LoopStats::print(FILE *out) {
+    fprintf(out, "Spin polls: %llu wakeups: %llu time: %llu us\n",
+        (unsigned long long) spin_polls,
+        (unsigned long long) spin_wakeups,
+        (unsigned long long) spin_usec);
+    fprintf(out, "Sleep polls: %llu wakeups: %llu time: %llu us\n",
+        (unsigned long long) sleep_polls,
+        (unsigned long long) sleep_wakeups,
+        (unsigned long long) sleep_usec);
+    fprintf(out, "Spin/sleep wakeup ratio: %.3f time ratio: %.3f\n",
+        spin_wakeup_ratio(), spin_time_ratio());
+    fprintf(out, "Throttled: %llu times for %llu us\n",
+        (unsigned long long) throttle_count,
+        (unsigned long long) throttled_usec);
+}
+
+void set_busy_poll(EventLoop &loop, int fd) {
+    if (loop.busy_poll_usec <= 0) {
+        return;
+    }
+
+#ifdef SO_BUSY_POLL
+    int usec = loop.busy_poll_usec;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        _trace("Failed to set SO_BUSY_POLL for socket: %d. %s", fd, strerror(errno));
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+        _trace("Failed to set SO_PREFER_BUSY_POLL for socket: %d. %s", fd, strerror(errno));
+    }
+#endif
+#else
+    _trace("Busy polling is not supported on this platform.");
+#endif
+}
+
+void pin_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (status != 0) {
+        _trace("Failed to pin loop thread to CPU %d. %s", cpu, strerror(status));
+    } else {
+        _trace("Loop thread pinned to CPU %d", cpu);
+    }
+#else
+    _trace("CPU pinning is not supported on this platform.");
+#endif
+}
+
 Client::Client() {
+    poll_slot = NULL;
+
     reset();
 }
 
@@ -53,87 +181,734 @@ void Client::reset() {
     read_completed = 0;
     read_write_flag = RW_STATE_NONE;
     is_connected = false;
+    zerocopy_threshold = 0;
+    zerocopy_sent = 0;
+    zerocopy_completed = 0;
+    zerocopy_timed = false;
+    zerocopy_owners.clear();
+    connection_id = 0;
+    handshake_deadline_usec = 0;
+    sync_poll_slot();
 
     handler.reset();
+    relay.reset();
+    write_owner.reset();
+    stream.reset();
+    tls.reset();
+    limit.reset();
+}
+
+void Client::set_fd(int new_fd) {
+    fd = new_fd;
+    sync_poll_slot();
+}
+
+void Client::set_connected(bool connected) {
+    is_connected = connected;
+    sync_poll_slot();
+}
+
+void Client::set_read_write_flag(uint32_t flags) {
+    read_write_flag = flags;
+    sync_poll_slot();
+}
+
+void Client::add_read_write_flag(uint32_t flags) {
+    set_read_write_flag(read_write_flag | flags);
+}
+
+void Client::clear_read_write_flag(uint32_t flags) {
+    set_read_write_flag(read_write_flag & ~flags);
+}
+
+void Client::sync_poll_slot() {
+    if (poll_slot == NULL) {
+        return;
+    }
+
+    poll_slot->fd = fd;
+    poll_slot->flags = read_write_flag | (is_connected ? 0 : POLL_CONNECTING) |
+        (zerocopy_pending() ? POLL_ZEROCOPY : 0) |
+        (zerocopy_pending() && zerocopy_timed ? POLL_ZEROCOPY_TIMED : 0) |
+        (limit && limit->throttled_until > 0 ? POLL_THROTTLED : 0);
+
+    if (!tls) {
+        return;
+    }
+
+    if (!tls->handshake_done) {
+        //Poll for what the handshake needs
+        poll_slot->flags |= POLL_HANDSHAKE | tls->want;
+    } else if (!tls->kernel_recv && tls->pending()) {
+        poll_slot->flags |= POLL_TLS_PENDING;
+    }
+}
+
+bool Client::enable_zerocopy(size_t threshold) {
+    if (tls) {
+        _trace("Zero copy send is not supported with TLS.");
+
+        return false;
+    }
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+        _trace("Failed to set SO_ZEROCOPY for socket: %d. %s", fd, strerror(errno));
+
+        return false;
+    }
+
+    zerocopy_threshold = threshold;
+
+    return true;
+#else
+    _trace("Zero copy send is not supported on this platform.");
+
+    return false;
+#endif
+}
+
+/*
+* Writes the next part of the write buffer. Large writes of a
+* client that enabled zero copy skip the copy to the kernel.
+*/
+ssize_t client_write(EventLoop &loop, Client &c, const char *buffer, size_t length) {
+    if (c.tls && !c.tls->kernel_send) {
+        return c.tls->write(buffer, length);
+    }
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+    if (c.zerocopy_threshold > 0 && length >= c.zerocopy_threshold) {
+        ssize_t n = send(c.fd, buffer, length, MSG_ZEROCOPY);
+
+        if (n > 0) {
+            //The kernel numbers each send that pins the buffer
+            ++c.zerocopy_sent;
+
+            //A later write may replace write_owner before the kernel is done
+            if (c.write_owner) {
+                if (!c.zerocopy_owners.empty() && c.zerocopy_owners.back().second == c.write_owner) {
+                    c.zerocopy_owners.back().first = c.zerocopy_sent;
+                } else {
+                    c.zerocopy_owners.emplace_back(c.zerocopy_sent, c.write_owner);
+                }
+            }
+
+            return n;
+        }
+
+        if (n == 0 || errno != ENOBUFS) {
+            return n;
+        }
+
+        //Out of memory to pin pages with. Copy this time.
+        _trace("Zero copy send failed with ENOBUFS. Copying.");
+    }
+#endif
+
+    return loop.transport->write(c.fd, buffer, length);
+}
+
+//Reads through the TLS session when the kernel doesn't decrypt
+ssize_t client_read(EventLoop &loop, Client &c, void *buffer, size_t length) {
+    if (!c.tls || c.tls->kernel_recv) {
+        return loop.transport->read(c.fd, buffer, length);
+    }
+
+    ssize_t n = c.tls->read(buffer, length);
+
+    //Whatever did not fit stays in the session
+    c.sync_poll_slot();
+
+    return n;
+}
+
+//How often the error queue is checked when readability can't tell
+const uint64_t ZEROCOPY_POLL_USEC = 1000;
+
+/*
+* Reads zero copy completions from the socket error queue. Returns
+* true when the kernel has released the buffers of all sends.
+*/
+bool reap_zerocopy(Client &c) {
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (c.zerocopy_pending()) {
+        char control[128];
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(c.fd, &msg, MSG_ERRQUEUE) < 0) {
+            //Nothing more for now
+            break;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            struct sock_extended_err *err = (struct sock_extended_err*) CMSG_DATA(cm);
+
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+
+            //Sends ee_info through ee_data are complete
+            c.zerocopy_completed += err->ee_data - err->ee_info + 1;
+
+            if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && c.zerocopy_threshold > 0) {
+                //The kernel copied anyway, as it does for loopback.
+                //Pinning pages only costs us here.
+                _trace("Zero copy fell back to copying for socket: %d. Disabling.", c.fd);
+
+                c.zerocopy_threshold = 0;
+            }
+        }
+    }
+#endif
+
+    //Let go of the buffers whose sends are all complete
+    while (!c.zerocopy_owners.empty() && (int32_t) (c.zerocopy_completed - c.zerocopy_owners.front().first) >= 0) {
+        c.zerocopy_owners.pop_front();
+    }
+
+    if (!c.zerocopy_pending()) {
+        c.zerocopy_timed = false;
+    }
+
+    c.sync_poll_slot();
+
+    return !c.zerocopy_pending();
+}
+
+/*
+* Called when a socket with zero copy sends in flight is readable and
+* by the timer. Calls on_write_completed once the kernel has released
+* the buffer of the last write. If nothing was released and the
+* handler isn't reading, unread bytes made the socket readable. Polling
+* it again would spin, so completions are checked on a timer instead.
+* Returns false if a handler disconnected the client.
+*/
+bool complete_zerocopy(EventLoop &loop, Server *server, Client &c) {
+    uint32_t completed = c.zerocopy_completed;
+
+    if (!reap_zerocopy(c)) {
+        if (c.zerocopy_completed == completed && !(c.read_write_flag & RW_STATE_READ) && !c.zerocopy_timed) {
+            _trace("Checking zero copy completions on a timer for socket: %d", c.fd);
+
+            c.zerocopy_timed = true;
+            c.sync_poll_slot();
+        }
+
+        return true;
+    }
+
+    if (c.read_write_flag & RW_STATE_WRITE) {
+        //A newer write is still going
+        return true;
+    }
+
+    //The kernel released the buffer of the last write
+    c.write_owner.reset();
+
+    if (server == NULL) {
+        if (c.handler) {
+            CALL_HANDLER(&loop, c.handler, on_write_completed, c.fd, c);
+        }
+    } else {
+        if (c.handler) {
+            CALL_HANDLER(&loop, c.handler, on_write_completed, c.fd, *server, c);
+        }
+        if (server->handler) {
+            CALL_HANDLER(&loop, server->handler, on_write_completed, c.fd, *server, c);
+        }
+    }
+
+    return c.in_use();
+}
+
+ClientInfo::ClientInfo() {
+    reset();
+}
+
+void ClientInfo::reset() {
+    host[0] = '\0';
+    port = 0;
+    num_addrs = 0;
+    next_addr = 0;
+    num_attempts = 0;
+    next_attempt_usec = 0;
+    deadline_usec = 0;
+    tls.reset();
+}
+
+Watch::Watch() {
+    reset();
+}
+
+void Watch::reset() {
+    fd = -1;
+    interest = RW_STATE_NONE;
+    handler.reset();
+}
+
+Timer::Timer() {
+    reset();
+}
+
+void Timer::reset() {
+    expires_usec = 0;
+    interval_usec = 0;
+    handler.reset();
 }
 
 Server::Server() {
+    loop = NULL;
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        client_state[i].poll_slot = &poll_state[i];
+    }
+
     reset();
 }
 
 void Server::reset() {
     server_socket = -1;
+    port = 0;
 
     for (auto& c : client_state) {
         c.reset();
     }
 
     handler.reset();
+    tls.reset();
+    limit.reset();
 }
 
 Server::~Server() {
     disconnect_clients();
 }
 
+Transport& Server::transport() {
+    static SocketTransport default_transport;
+
+    if (loop != NULL && loop->transport) {
+        return *loop->transport;
+    }
+
+    return default_transport;
+}
+
+int SocketTransport::listen(int port) {
+    int status;
+    
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    
+    DIE(sock, "Failed to open socket.");
+    
+    status = fcntl(sock, F_SETFL, O_NONBLOCK);
+    DIE(status, "Failed to set non blocking mode for server listener socket.");
+    
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    
+    struct sockaddr_in addr;
+    
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    
+    status = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+    
+    DIE(status, "Failed to bind to port.");
+    
+    _trace("Calling listen.");
+    status = ::listen(sock, 10);
+    _trace("listen returned.");
+    
+    DIE(status, "Failed to listen.");
+
+    return sock;
+}
+
+int SocketTransport::accept(int listen_fd) {
+    int fd = ::accept(listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    int status = fcntl(fd, F_SETFL, O_NONBLOCK);
+    DIE(status, "Failed to set non blocking mode for client socket.");
+
+    return fd;
+}
+
+int SocketTransport::connect(const struct sockaddr *addr, socklen_t addr_len) {
+	int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+
+    if (sock < 0) {
+        _trace("Failed to open socket.");
+        
+        return -1;
+    }
+
+    //Make the socket non-blocking
+	int status = fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    if (status < 0) {
+        _trace("Failed to set non blocking mode for socket.");
+
+        ::close(sock);
+
+        return -1;
+    }
+
+	status = ::connect(sock, addr, addr_len);
+
+	if (status < 0 && errno != EINPROGRESS) {
+		perror("Failed to connect to port.");
+
+		::close(sock);
+
+		return -1;
+	}
+
+    return sock;
+}
+
+int SocketTransport::connect_error(int fd) {
+    int valopt; 
+    socklen_t lon = sizeof(int); 
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
+        perror("Error in getsockopt()");
+
+        return -1;
+    }
+
+    return valopt;
+}
+
+ssize_t SocketTransport::read(int fd, void *buffer, size_t length) {
+    return ::read(fd, buffer, length);
+}
+
+ssize_t SocketTransport::write(int fd, const void *buffer, size_t length) {
+    return ::write(fd, buffer, length);
+}
+
+int SocketTransport::shutdown_write(int fd) {
+    return ::shutdown(fd, SHUT_WR);
+}
+
+void SocketTransport::close(int fd) {
+    ::close(fd);
+}
+
+int SocketTransport::select(int nfds, fd_set *read_fd_set, fd_set *write_fd_set, struct timeval *timeout) {
+    return ::select(nfds, read_fd_set, write_fd_set, NULL, timeout);
+}
+
+HandlerPool::HandlerPool() {
+    for (auto& list : free_lists) {
+        list = NULL;
+    }
+
+    chunk_next = NULL;
+    chunk_end = NULL;
+    allocations = 0;
+    recycled = 0;
+}
+
+HandlerPool::~HandlerPool() {
+    for (char *chunk : chunks) {
+        ::operator delete(chunk, std::align_val_t(BLOCK_SIZE));
+    }
+}
+
+//Takes a new block from the newest chunk
+void* HandlerPool::carve(size_t size) {
+    if (chunk_next == NULL || (size_t) (chunk_end - chunk_next) < size) {
+        //The rest of the old chunk is too small for this size class
+        chunks.push_back((char*) ::operator new(CHUNK_SIZE, std::align_val_t(BLOCK_SIZE)));
+
+        chunk_next = chunks.back();
+        chunk_end = chunk_next + CHUNK_SIZE;
+    }
+
+    void *p = chunk_next;
+
+    chunk_next += size;
+
+    return p;
+}
+
+//Defined in migration.cpp
+void open_migration_channel(EventLoop &loop);
+void close_migration_channel(EventLoop &loop);
+void publish_load(EventLoop &loop);
+
+//Defined in restart.cpp
+int take_inherited_listener(EventLoop &loop, int port);
+void close_restart_channel(EventLoop &loop);
+void check_drained(EventLoop &loop);
+
+//Defined in capture.cpp
+void capture_record(EventLoop &loop, Client &c, uint8_t type, const char *buffer, uint32_t length);
+void capture_open(EventLoop &loop, Server &server, Client &c);
+
+//Defined in rate_limit.cpp
+void charge_io(EventLoop &loop, Server *server, Client &c, size_t bytes);
+void release_throttled(EventLoop &loop);
+
 EventLoop::EventLoop() {
     continue_loop = false;
     idle_timeout = 0;
+    tls_pending_fds = 0;
+    zerocopy_timed_fds = 0;
+    handshaking_fds = 0;
+    handshake_timeout_ms = 10000;
+    throttle_wake_usec = 0;
+    spin_usec = 0;
+    busy_poll_usec = 0;
+    cpu = -1;
+    connect_stagger_ms = 250;
+    signal_fd = -1;
+    migration_pipe[0] = -1;
+    migration_pipe[1] = -1;
+    published_idle_usec = 0;
+    published_sleep_start = now_usec();
+    published_clients = 0;
+    shed_count = 0;
+    shed_target = NULL;
+    capture_file = NULL;
+    capture_start_usec = 0;
+    next_connection_id = 0;
+    slow_callback_usec = 0;
+    num_slow_callbacks = 0;
+    callback_timing = false;
+    current_handler_type = NULL;
+    current_callback = NULL;
+    current_fd = -1;
+    iterations = 0;
+    loop_thread = pthread_self();
+    watchdog_ms = 0;
+    watchdog_running = false;
+    watchdog_stalls = 0;
+    restart_fd = -1;
+    num_inherited = 0;
+    draining = false;
+    drain_timeout_ms = 0;
+
+    transport = std::make_shared<SocketTransport>();
 
     for (auto& s : server_state) {
+        s.loop = this;
         s.reset();
     }
 
-    for (auto& c : client_state) {
-        c.reset();
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        client_state[i].poll_slot = &client_poll_state[i];
+        client_state[i].reset();
+    }
+
+    for (int i = 0; i <= MAX_SERVERS; ++i) {
+        migrations_queued[i] = 0;
+    }
+
+    open_migration_channel(*this);
+    publish_load(*this);
+}
+
+EventLoop::~EventLoop() {
+    for (int signo = 1; signo < NSIG; ++signo) {
+        if (signal_handlers[signo]) {
+            remove_signal(signo);
+        }
     }
+
+    stop_watchdog();
+    close_restart_channel(*this);
+    close_migration_channel(*this);
+    stop_capture();
 }
 
-void populate_fd_set(EventLoop &loop, fd_set &read_fd_set, fd_set &write_fd_set) {
+/*
+* Sets up the fd sets for select(). Returns one more than the
+* largest descriptor set, so that select() does not have to
+* scan the whole set.
+*/
+int populate_fd_set(EventLoop &loop, fd_set &read_fd_set, fd_set &write_fd_set) {
+    int nfds = 0;
+
     FD_ZERO(&read_fd_set);
     FD_ZERO(&write_fd_set);
+
+    loop.tls_pending_fds = 0;
+    loop.zerocopy_timed_fds = 0;
+    loop.handshaking_fds = 0;
     
     for (auto& server : loop.server_state) {
         if (server.in_use()) {
-            //Set the server socket
-            FD_SET(server.server_socket, &read_fd_set);
+            //Set the server socket. A draining loop leaves
+            //new connections to its successor.
+            if (!loop.draining) {
+                FD_SET(server.server_socket, &read_fd_set);
+            }
+
+            if (server.server_socket >= nfds) {
+                nfds = server.server_socket + 1;
+            }
             
-            //Set the clients
-            for (auto& c : server.client_state) {
-                if (!c.in_use()) {
+            //Set the clients. Throttled ones wait for tokens.
+            bool server_throttled = server.limit && server.limit->throttled_until > 0;
+
+            for (auto& p : server.poll_state) {
+                if (p.fd < 0 || server_throttled || (p.flags & POLL_THROTTLED)) {
                     continue;
                 }
+
+                if (p.fd >= nfds) {
+                    nfds = p.fd + 1;
+                }
                 
-                if (c.read_write_flag & RW_STATE_READ) {
-                    FD_SET(c.fd, &read_fd_set);
+                //Zero copy completions show up as a readable socket
+                if ((p.flags & RW_STATE_READ) || (p.flags & (POLL_ZEROCOPY | POLL_ZEROCOPY_TIMED)) == POLL_ZEROCOPY) {
+                    FD_SET(p.fd, &read_fd_set);
+                }
+                if (p.flags & POLL_ZEROCOPY_TIMED) {
+                    ++loop.zerocopy_timed_fds;
+                }
+                if ((p.flags & (RW_STATE_READ | POLL_TLS_PENDING)) == (RW_STATE_READ | POLL_TLS_PENDING)) {
+                    ++loop.tls_pending_fds;
+                }
+                if (p.flags & POLL_HANDSHAKE) {
+                    ++loop.handshaking_fds;
                 }
-                if (c.read_write_flag & RW_STATE_WRITE) {
-                    FD_SET(c.fd, &write_fd_set);
+                if (p.flags & RW_STATE_WRITE) {
+                    FD_SET(p.fd, &write_fd_set);
                 }
             }
         }
     }
 
-    for (auto& client : loop.client_state) {
-        if (client.in_use()) {
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        auto& p = loop.client_poll_state[i];
+
+        if (p.flags & POLL_CONNECTING) {
+            //A completed connection attempt is indicated by a write event
+            auto& info = loop.client_info[i];
+
+            for (int k = 0; k < info.num_attempts; ++k) {
+                int fd = info.attempt_fds[k];
+
+                FD_SET(fd, &write_fd_set);
+
+                if (fd >= nfds) {
+                    nfds = fd + 1;
+                }
+            }
+        } else if (p.fd >= 0 && !(p.flags & POLL_THROTTLED)) {
+            if (p.fd >= nfds) {
+                nfds = p.fd + 1;
+            }
+
             /*
             * We need to enable read select no matter what
             * the value of read_write_flag is. This is 
             * because an orderly disconnect by the server
             * is signalled using a failed read and we need
-            * to know that.
+            * to know that. The exception is a relay
+            * or stream that can not take more data and
+            * a socket waiting for zero copy completions
+            * on the timer.
             */
-            FD_SET(client.fd, &read_fd_set);
+            if (!(p.flags & (RW_STATE_RELAY | RW_STATE_STREAM | POLL_ZEROCOPY_TIMED)) || (p.flags & RW_STATE_READ)) {
+                FD_SET(p.fd, &read_fd_set);
+            }
+            if (p.flags & POLL_ZEROCOPY_TIMED) {
+                ++loop.zerocopy_timed_fds;
+            }
+            if ((p.flags & (RW_STATE_READ | POLL_TLS_PENDING)) == (RW_STATE_READ | POLL_TLS_PENDING)) {
+                ++loop.tls_pending_fds;
+            }
 
-            /*
-            * Enable write select if writing is scheduled, or,
-            * an asynchronous connection is initiated but hasn't completed yet.
-            * A completed connection is indicated by a write event.
-            */
-            if ((client.read_write_flag & RW_STATE_WRITE) || (client.is_connected == false)) {
-                FD_SET(client.fd, &write_fd_set);
+            //Enable write select if writing is scheduled
+            if (p.flags & RW_STATE_WRITE) {
+                FD_SET(p.fd, &write_fd_set);
+            }
+        }
+    }
+
+    for (auto& w : loop.watch_state) {
+        if (!w.in_use()) {
+            continue;
+        }
+
+        if (w.interest & RW_STATE_READ) {
+            FD_SET(w.fd, &read_fd_set);
+        }
+        if (w.interest & RW_STATE_WRITE) {
+            FD_SET(w.fd, &write_fd_set);
+        }
+
+        if (w.fd >= nfds) {
+            nfds = w.fd + 1;
+        }
+    }
+
+    return nfds;
+}
+
+/*
+* Marks the readers whose TLS session holds decrypted bytes as
+* readable. select() only knows about bytes in the socket.
+*/
+int mark_tls_pending(EventLoop &loop, fd_set &read_fd_set) {
+    int marked = 0;
+    auto mark = [&](PollSlot &p) {
+        if (p.fd >= 0 && (p.flags & (RW_STATE_READ | POLL_TLS_PENDING | POLL_THROTTLED)) == (RW_STATE_READ | POLL_TLS_PENDING)) {
+            FD_SET(p.fd, &read_fd_set);
+            ++marked;
+        }
+    };
+
+    for (auto& server : loop.server_state) {
+        if (server.in_use() && !(server.limit && server.limit->throttled_until > 0)) {
+            for (auto& p : server.poll_state) {
+                mark(p);
             }
         }
     }
+
+    for (auto& p : loop.client_poll_state) {
+        mark(p);
+    }
+
+    return marked;
+}
+
+//Advances a TLS handshake. Returns 1 once it is done and -1 if it failed.
+int continue_handshake(EventLoop &loop, Client &c) {
+    int status = c.tls->handshake();
+
+    c.sync_poll_slot();
+
+    if (status > 0) {
+        _trace("TLS handshake completed for socket: %d. Kernel send: %d receive: %d",
+            c.fd, c.tls->kernel_send, c.tls->kernel_recv);
+    } else if (status < 0) {
+        _trace("TLS handshake failed for socket: %d", c.fd);
+    }
+
+    return status;
 }
 
 void Server::disconnect_clients() {
@@ -149,10 +924,36 @@ void Server::disconnect_clients() {
 bool Server::add_client_fd(int fd) {
     for (auto& c : client_state) {
         if (!c.in_use()) {
-            c.fd = fd;
+            c.set_fd(fd);
+            c.set_connected(true);
+
+            if (tls) {
+                c.tls = tls->open_session(fd, NULL);
+
+                if (!c.tls) {
+                    c.reset();
+
+                    return false;
+                }
+
+                if (loop != NULL && loop->handshake_timeout_ms > 0) {
+                    c.handshake_deadline_usec = now_usec() + (uint64_t) loop->handshake_timeout_ms * 1000;
+                }
+            }
+
+            c.sync_poll_slot();
+
+            if (loop != NULL && loop->capture_file != NULL) {
+                capture_open(*loop, *this, c);
+            }
+
+            if (c.handshaking()) {
+                //on_client_connect is called once the handshake is done
+                return true;
+            }
 
             if (handler) {
-                handler->on_client_connect(*this, c);
+                CALL_HANDLER(loop, handler, on_client_connect, c.fd, *this, c);
             }
 
             return true;
@@ -166,6 +967,10 @@ bool Server::add_client_fd(int fd) {
 bool Server::remove_client_fd(int fd) {
     for (auto& c : client_state) {
         if (c.in_use() && c.fd == fd) {
+            if (loop != NULL && loop->capture_file != NULL) {
+                capture_record(*loop, c, CAPTURE_CLOSE, NULL, 0);
+            }
+
             c.reset();
 
             return true;
@@ -176,7 +981,93 @@ bool Server::remove_client_fd(int fd) {
     return false;
 }
 
-int handle_client_write(Server& server, Client &cli_state) {
+/*
+* Reads into the StreamBuffer of a client in streaming read mode.
+* Returns like a transport read and points new_bytes at what was
+* read. Reading pauses once the buffer is full at its maximum size.
+*/
+int stream_read(EventLoop &loop, Client &cli_state, const char *&new_bytes) {
+    StreamBuffer &stream = *cli_state.stream;
+    size_t room;
+    char *tail = stream.reserve(room);
+
+    if (tail == NULL) {
+        cli_state.clear_read_write_flag(RW_STATE_READ);
+
+        errno = EAGAIN;
+
+        return -1;
+    }
+
+    int bytes_read = client_read(loop, cli_state, tail, room);
+
+    _trace("Streamed %d bytes. Buffered: %lu of %lu", bytes_read, stream.size() + (bytes_read > 0 ? bytes_read : 0), stream.capacity);
+
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+
+    stream.commit(bytes_read);
+    new_bytes = tail;
+
+    if (stream.full() && stream.capacity == stream.max_capacity) {
+        //Wait for the handler to consume
+        _trace("Stream buffer is full for socket: %d", cli_state.fd);
+
+        cli_state.clear_read_write_flag(RW_STATE_READ);
+    }
+
+    return bytes_read;
+}
+
+int handle_client_stream(EventLoop &loop, Server& server, Client &cli_state) {
+    const char *buffer_start = NULL;
+    int bytes_read = stream_read(loop, cli_state, buffer_start);
+
+    if (bytes_read < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (bytes_read == 0) {
+        //Client has disconnected. We convert that to an error.
+        return -1;
+    }
+
+    if (cli_state.limit || server.limit) {
+        charge_io(loop, &server, cli_state, bytes_read);
+    }
+
+    if (loop.capture_file != NULL) {
+        capture_record(loop, cli_state, CAPTURE_READ, buffer_start, bytes_read);
+    }
+
+    //Keep buffer_start valid until both handlers are done
+    cli_state.stream->dispatching = true;
+
+    if (cli_state.handler) {
+        CALL_HANDLER(&loop, cli_state.handler, on_read, cli_state.fd, server, cli_state, buffer_start, bytes_read);
+    }
+    //The client handler may have stopped the stream. A new one isn't dispatching.
+    if (server.handler && cli_state.stream && cli_state.stream->dispatching) {
+        CALL_HANDLER(&loop, server.handler, on_read, cli_state.fd, server, cli_state, buffer_start, bytes_read);
+    }
+
+    if (cli_state.stream && cli_state.stream->dispatching) {
+        cli_state.stream->dispatching = false;
+        cli_state.stream->shrink();
+    }
+
+    return bytes_read;
+}
+
+int handle_client_write(EventLoop &loop, Server& server, Client &cli_state) {
+    if (cli_state.read_write_flag & RW_STATE_STREAM) {
+        return handle_client_stream(loop, server, cli_state);
+    }
     if (!(cli_state.read_write_flag & RW_STATE_READ)) {
         _trace("Socket is not trying to read.");
         
@@ -195,7 +1086,7 @@ int handle_client_write(Server& server, Client &cli_state) {
     
     const char *buffer_start = cli_state.read_buffer + cli_state.read_completed;
 
-    int bytes_read = read(cli_state.fd,
+    int bytes_read = client_read(loop, cli_state,
                          (void*) buffer_start,
                          cli_state.read_length - cli_state.read_completed);
     
@@ -219,27 +1110,35 @@ int handle_client_write(Server& server, Client &cli_state) {
     
     cli_state.read_completed += bytes_read;
 
+    if (cli_state.limit || server.limit) {
+        charge_io(loop, &server, cli_state, bytes_read);
+    }
+
+    if (loop.capture_file != NULL) {
+        capture_record(loop, cli_state, CAPTURE_READ, buffer_start, bytes_read);
+    }
+
     if (cli_state.handler) {
-        cli_state.handler->on_read(server, cli_state, buffer_start, bytes_read);
+        CALL_HANDLER(&loop, cli_state.handler, on_read, cli_state.fd, server, cli_state, buffer_start, bytes_read);
     }
     if (server.handler) {
-        server.handler->on_read(server, cli_state, buffer_start, bytes_read);
+        CALL_HANDLER(&loop, server.handler, on_read, cli_state.fd, server, cli_state, buffer_start, bytes_read);
     }
 
     if (cli_state.read_completed == cli_state.read_length) {
-        cli_state.read_write_flag = cli_state.read_write_flag & (~RW_STATE_READ);
+        cli_state.clear_read_write_flag(RW_STATE_READ);
         if (cli_state.handler) {
-            cli_state.handler->on_read_completed(server, cli_state);
+            CALL_HANDLER(&loop, cli_state.handler, on_read_completed, cli_state.fd, server, cli_state);
         }        
         if (server.handler) {
-            server.handler->on_read_completed(server, cli_state);
+            CALL_HANDLER(&loop, server.handler, on_read_completed, cli_state.fd, server, cli_state);
         }
     }
     
     return bytes_read;
 }
 
-int handle_client_read(Server& server, Client &cli_state) {
+int handle_client_read(EventLoop &loop, Server& server, Client &cli_state) {
     if (!(cli_state.read_write_flag & RW_STATE_WRITE)) {
         _trace("Socket is not trying to write.");
         
@@ -257,8 +1156,8 @@ int handle_client_read(Server& server, Client &cli_state) {
     }
     
     const char *buffer_start = cli_state.write_buffer + cli_state.write_completed;
-    int bytes_written = write(cli_state.fd,
-                             (void*) buffer_start,
+    int bytes_written = client_write(loop, cli_state,
+                             buffer_start,
                              cli_state.write_length - cli_state.write_completed);
     
     _trace("Written %d of %d bytes", bytes_written, cli_state.write_length);
@@ -279,21 +1178,37 @@ int handle_client_read(Server& server, Client &cli_state) {
     }
     
     cli_state.write_completed += bytes_written;
+
+    if (cli_state.limit || server.limit) {
+        charge_io(loop, &server, cli_state, bytes_written);
+    }
+
+    if (loop.capture_file != NULL) {
+        capture_record(loop, cli_state, CAPTURE_WRITE, buffer_start, bytes_written);
+    }
     
     if (cli_state.handler) {
-        cli_state.handler->on_write(server, cli_state, buffer_start, bytes_written);
+        CALL_HANDLER(&loop, cli_state.handler, on_write, cli_state.fd, server, cli_state, buffer_start, bytes_written);
     }
     if (server.handler) {
-        server.handler->on_write(server, cli_state, buffer_start, bytes_written);
+        CALL_HANDLER(&loop, server.handler, on_write, cli_state.fd, server, cli_state, buffer_start, bytes_written);
     }
     
     if (cli_state.write_completed == cli_state.write_length) {
-        cli_state.read_write_flag &= ~RW_STATE_WRITE;
+        cli_state.clear_read_write_flag(RW_STATE_WRITE);
+
+        if (cli_state.zerocopy_pending() && !reap_zerocopy(cli_state)) {
+            //Completed once the kernel lets go of the buffer
+            return bytes_written;
+        }
+
+        cli_state.write_owner.reset();
+
         if (cli_state.handler) {
-            cli_state.handler->on_write_completed(server, cli_state);
+            CALL_HANDLER(&loop, cli_state.handler, on_write_completed, cli_state.fd, server, cli_state);
         }
         if (server.handler) {
-            server.handler->on_write_completed(server, cli_state);
+            CALL_HANDLER(&loop, server.handler, on_write_completed, cli_state.fd, server, cli_state);
         }
     }
     
@@ -304,56 +1219,350 @@ void Server::disconnect_client(Client &cli_state) {
     _trace("Disconnecting client: %d", cli_state.fd);
 
     if (handler) {
-        handler->on_client_disconnect(*this, cli_state);
+        CALL_HANDLER(loop, handler, on_client_disconnect, cli_state.fd, *this, cli_state);
     }
 
-    close(cli_state.fd);
+    transport().close(cli_state.fd);
     remove_client_fd(cli_state.fd);
 }
 
-void dispatch_server_event(Server &state, fd_set &read_fd_set, fd_set &write_fd_set) {
+int Server::broadcast(std::shared_ptr<const void> owner, const char *buffer, size_t length, int policy) {
+    int scheduled = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        auto& p = poll_state[i];
+
+        if (p.fd < 0 || (p.flags & (RW_STATE_RELAY | POLL_HANDSHAKE))) {
+            continue;
+        }
+
+        auto& c = client_state[i];
+
+        if (p.flags & (RW_STATE_WRITE | POLL_ZEROCOPY)) {
+            //Still busy with an earlier message
+            if (policy == BROADCAST_DROP_BUSY) {
+                _trace("Dropping slow client: %d", c.fd);
+
+                disconnect_client(c);
+            }
+
+            continue;
+        }
+
+        c.schedule_write(owner, buffer, length);
+
+        ++scheduled;
+    }
+
+    _trace("Broadcast %d bytes to %d clients", length, scheduled);
+
+    return scheduled;
+}
+
+const size_t RELAY_BUFFER_SIZE = 64 * 1024;
+
+/*
+* One direction of a relay. Bytes read from one end wait here
+* until the other end can take them. With splice() they wait
+* in a kernel pipe, otherwise in a user space ring buffer.
+*/
+struct RelayChannel {
+    int pipe_fds[2];
+    std::vector<char> buffer;
+    size_t head;
+    size_t pending;
+    size_t capacity;
+    bool eof; //The reading end ended its stream
+    bool done; //Everything was forwarded and the writing end was shut down
+
+    RelayChannel() {
+        pipe_fds[0] = -1;
+        pipe_fds[1] = -1;
+        head = 0;
+        pending = 0;
+        capacity = 0;
+        eof = false;
+        done = false;
+    }
+};
+
+struct Relay {
+    Client *ends[2];
+    RelayChannel channels[2]; //channels[i] carries the bytes read from ends[i]
+    bool use_splice;
+
+    ~Relay() {
+        for (auto& ch : channels) {
+            if (ch.pipe_fds[0] >= 0) {
+                close(ch.pipe_fds[0]);
+                close(ch.pipe_fds[1]);
+            }
+        }
+    }
+};
+
+//Moves bytes from ends[i] into channel i. Returns -1 on error.
+int relay_fill(EventLoop &loop, Relay &relay, int i) {
+    RelayChannel &ch = relay.channels[i];
+    int fd = relay.ends[i]->fd;
+    size_t room = ch.capacity - ch.pending;
+
+    if (room == 0 || ch.eof) {
+        return 0;
+    }
+
+    ssize_t bytes_read;
+
+    if (relay.use_splice) {
+#ifdef __linux__
+        bytes_read = splice(fd, NULL, ch.pipe_fds[1], NULL, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        bytes_read = -1;
+        errno = ENOSYS;
+#endif
+    } else {
+        size_t tail = (ch.head + ch.pending) % ch.capacity;
+        size_t length = tail >= ch.head ? ch.capacity - tail : ch.head - tail;
+
+        bytes_read = loop.transport->read(fd, ch.buffer.data() + tail, length < room ? length : room);
+    }
+
+    _trace("Relay read %d bytes from socket: %d", (int) bytes_read, fd);
+
+    if (bytes_read < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (bytes_read == 0) {
+        //Stop reading. The bytes still in the channel go out first.
+        ch.eof = true;
+
+        return 0;
+    }
+
+    ch.pending += bytes_read;
+
+    return bytes_read;
+}
+
+//Moves bytes from channel i to the other end. Returns -1 on error.
+int relay_drain(EventLoop &loop, Relay &relay, int i) {
+    RelayChannel &ch = relay.channels[i];
+    Client &to = *relay.ends[1 - i];
+
+    if (ch.pending == 0 || !to.is_connected) {
+        return 0;
+    }
+
+    ssize_t bytes_written;
+
+    if (relay.use_splice) {
+#ifdef __linux__
+        bytes_written = splice(ch.pipe_fds[0], NULL, to.fd, NULL, ch.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        bytes_written = -1;
+        errno = ENOSYS;
+#endif
+    } else {
+        size_t length = ch.capacity - ch.head;
+
+        bytes_written = loop.transport->write(to.fd, ch.buffer.data() + ch.head, length < ch.pending ? length : ch.pending);
+    }
+
+    _trace("Relay wrote %d bytes to socket: %d", (int) bytes_written, to.fd);
+
+    if (bytes_written < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    ch.pending -= bytes_written;
+
+    if (!relay.use_splice) {
+        ch.head = ch.pending == 0 ? 0 : (ch.head + bytes_written) % ch.capacity;
+    }
+
+    return bytes_written;
+}
+
+/*
+* Passes an end of stream on once its channel is empty. Returns 1
+* when both directions are done, -1 on error.
+*/
+int relay_finish(EventLoop &loop, Relay &relay) {
+    for (int i = 0; i < 2; ++i) {
+        RelayChannel &ch = relay.channels[i];
+        Client &to = *relay.ends[1 - i];
+
+        if (!ch.eof || ch.done || ch.pending > 0 || !to.is_connected) {
+            continue;
+        }
+
+        _trace("Relay shutting down writes to socket: %d", to.fd);
+
+        if (loop.transport->shutdown_write(to.fd) < 0) {
+            return -1;
+        }
+
+        ch.done = true;
+    }
+
+    return relay.channels[0].done && relay.channels[1].done ? 1 : 0;
+}
+
+//Only read from an end when its channel has room and only
+//write to it when the other channel has bytes.
+void relay_update_flags(Relay &relay) {
+    for (int i = 0; i < 2; ++i) {
+        Client &c = *relay.ends[i];
+        uint32_t flags = RW_STATE_RELAY;
+
+        if (c.is_connected && !relay.channels[i].eof && relay.channels[i].pending < relay.channels[i].capacity) {
+            flags |= RW_STATE_READ;
+        }
+        if (c.is_connected && relay.channels[1 - i].pending > 0) {
+            flags |= RW_STATE_WRITE;
+        }
+
+        c.set_read_write_flag(flags);
+    }
+}
+
+void relay_shutdown(EventLoop &loop, std::shared_ptr<Relay> relay) {
+    for (Client *c : relay->ends) {
+        if (c->relay != relay) {
+            //Already disconnected
+            continue;
+        }
+
+        c->relay.reset();
+        c->set_read_write_flag(RW_STATE_NONE);
+
+        loop.disconnect_client(*c);
+    }
+}
+
+void handle_relay_event(EventLoop &loop, Client &c, bool readable, bool writable) {
+    //Keep the relay alive in case it shuts down
+    std::shared_ptr<Relay> relay = c.relay;
+    int i = relay->ends[0] == &c ? 0 : 1;
+    int status = 0;
+
+    if (writable) {
+        status = relay_drain(loop, *relay, 1 - i);
+    }
+
+    if (status >= 0 && readable) {
+        status = relay_fill(loop, *relay, i);
+
+        //Forward right away instead of waiting for the next iteration
+        if (status >= 0) {
+            status = relay_drain(loop, *relay, i);
+        }
+    }
+
+    if (status >= 0) {
+        status = relay_finish(loop, *relay);
+    }
+
+    if (status != 0) {
+        _trace("Relay closed by socket: %d", c.fd);
+
+        relay_shutdown(loop, relay);
+
+        return;
+    }
+
+    relay_update_flags(*relay);
+}
+
+void dispatch_server_event(EventLoop &loop, Server &state, fd_set &read_fd_set, fd_set &write_fd_set) {
     //Make sense out of the event
     if (FD_ISSET(state.server_socket, &read_fd_set)) {
         _trace("Client is connecting...");
-        int client_fd = accept(state.server_socket, NULL, NULL);
+        int client_fd = loop.transport->accept(state.server_socket);
+
+        if (client_fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            //The connection went away before we could accept it
+            return;
+        }
         
         DIE(client_fd, "accept() failed.");
         
+        set_busy_poll(loop, client_fd);
+
         bool added = state.add_client_fd(client_fd);
         
         if (!added) {
             _trace("Too many clients. Disconnecting...");
 
-            close(client_fd);
+            loop.transport->close(client_fd);
             state.remove_client_fd(client_fd);
 
             return;
         }
-        
-        int status = fcntl(client_fd, F_SETFL, O_NONBLOCK);
-        DIE(status, "Failed to set non blocking mode for client socket.");
     } else {
         //Client wrote something or disconnected
-        for (auto& c : state.client_state) {
-            
-            if (!c.in_use()) {
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            int fd = state.poll_state[i].fd;
+
+            if (fd < 0) {
                 //This slot is not in use
                 continue;
             }
-            
-            if (FD_ISSET(c.fd, &read_fd_set)) {
-                int status = handle_client_write(state, c);
 
-                if (status < 1) {
+            if (!FD_ISSET(fd, &read_fd_set) && !FD_ISSET(fd, &write_fd_set)) {
+                //Nothing to do. Leave the Client alone.
+                continue;
+            }
+
+            auto& c = state.client_state[i];
+
+            if (c.read_write_flag & RW_STATE_RELAY) {
+                handle_relay_event(loop, c, FD_ISSET(fd, &read_fd_set), FD_ISSET(fd, &write_fd_set));
+
+                continue;
+            }
+
+            if (c.handshaking()) {
+                int status = continue_handshake(loop, c);
+
+                if (status < 0) {
+                    loop.transport->close(c.fd);
+                    state.remove_client_fd(c.fd);
+                } else if (status > 0) {
+                    c.handshake_deadline_usec = 0;
+
+                    if (state.handler) {
+                        CALL_HANDLER(&loop, state.handler, on_client_connect, c.fd, state, c);
+                    }
+                }
+
+                continue;
+            }
+            
+            bool readable = FD_ISSET(c.fd, &read_fd_set);
+
+            if (readable && (state.poll_state[i].flags & POLL_ZEROCOPY)) {
+                if (!complete_zerocopy(loop, &state, c)) {
+                    continue;
+                }
+
+                //The error queue may have been all there was to read
+                readable = c.read_write_flag & RW_STATE_READ;
+            }
+
+            if (readable) {
+                int status = handle_client_write(loop, state, c);
+
+                if (status < 0) {
                     //Client has disconnected
                     _trace("Client has disconnected. Status: %d", status);
 
                     if (state.handler) {
-                        state.handler->on_client_disconnect(state, c);
+                        CALL_HANDLER(&loop, state.handler, on_client_disconnect, c.fd, state, c);
                     }
 
                     _trace("Closing client socket: %d", c.fd);
-                    close(c.fd);
+                    loop.transport->close(c.fd);
                     state.remove_client_fd(c.fd);
                 }
             }
@@ -365,18 +1574,18 @@ void dispatch_server_event(Server &state, fd_set &read_fd_set, fd_set &write_fd_
             }
             
             if (FD_ISSET(c.fd, &write_fd_set)) {
-                int status = handle_client_read(state, c);
+                int status = handle_client_read(loop, state, c);
 
-                if (status < 1) {
+                if (status < 0) {
                     //Client disconnected
                     _trace("Client has disconnected. Status: %d", status);
 
                     if (state.handler) {
-                        state.handler->on_client_disconnect(state, c);
+                        CALL_HANDLER(&loop, state.handler, on_client_disconnect, c.fd, state, c);
                     }
 
                     _trace("Closing client socket: %d", c.fd);
-                    close(c.fd);
+                    loop.transport->close(c.fd);
                     state.remove_client_fd(c.fd);
                 }
             }
@@ -384,7 +1593,7 @@ void dispatch_server_event(Server &state, fd_set &read_fd_set, fd_set &write_fd_
     }
 }
 
-int handle_server_read(Client cli_state) {
+int handle_server_read(EventLoop &loop, Client &cli_state) {
     if (!(cli_state.read_write_flag & RW_STATE_WRITE)) {
             _trace("Socket is not trying to write.");
             return -1;
@@ -399,8 +1608,8 @@ int handle_server_read(Client cli_state) {
     }
 
     const char *buffer_start = cli_state.write_buffer + cli_state.write_completed;
-    int bytes_written = write(cli_state.fd,
-            (void*) buffer_start,
+    int bytes_written = client_write(loop, cli_state,
+            buffer_start,
             cli_state.write_length - cli_state.write_completed);
     
     _trace("Written %d of %d bytes", bytes_written, cli_state.write_length);
@@ -425,29 +1634,71 @@ int handle_server_read(Client cli_state) {
 
     cli_state.write_completed += bytes_written;
 
+    if (cli_state.limit) {
+        charge_io(loop, NULL, cli_state, bytes_written);
+    }
+
     if (cli_state.handler) {
-        cli_state.handler->on_write(cli_state, buffer_start, bytes_written);
+        CALL_HANDLER(&loop, cli_state.handler, on_write, cli_state.fd, cli_state, buffer_start, bytes_written);
     }
 
     if (cli_state.write_completed == cli_state.write_length) {
         //Write is completed. Cancel further write.
         cli_state.cancel_write();
 
+        if (cli_state.zerocopy_pending() && !reap_zerocopy(cli_state)) {
+            //Completed once the kernel lets go of the buffer
+            return bytes_written;
+        }
+
+        cli_state.write_owner.reset();
+
         if (cli_state.handler) {
-            cli_state.handler->on_write_completed(cli_state);
+            CALL_HANDLER(&loop, cli_state.handler, on_write_completed, cli_state.fd, cli_state);
         }
     }
 
     return bytes_written;
 }
 
-int handle_server_write(Client &cli_state) {
+int handle_server_stream(EventLoop &loop, Client &cli_state) {
+    const char *buffer_start = NULL;
+    int bytes_read = stream_read(loop, cli_state, buffer_start);
+
+    if (bytes_read < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (bytes_read == 0) {
+        //Orderly disconnect by the server
+        return -1;
+    }
+
+    if (cli_state.limit) {
+        charge_io(loop, NULL, cli_state, bytes_read);
+    }
+
+    if (cli_state.handler) {
+        CALL_HANDLER(&loop, cli_state.handler, on_read, cli_state.fd, cli_state, buffer_start, bytes_read);
+    }
+
+    return bytes_read;
+}
+
+int handle_server_write(EventLoop &loop, Client &cli_state) {
+    if ((cli_state.read_write_flag & (RW_STATE_STREAM | RW_STATE_READ)) == (RW_STATE_STREAM | RW_STATE_READ)) {
+        return handle_server_stream(loop, cli_state);
+    }
     if (!(cli_state.read_write_flag & RW_STATE_READ)) {
         //Socket is not trying to read. Possibly a
 		//server disconnect signal.
 		char ch;
 
-		int bytes_read = read(cli_state.fd,
+		int bytes_read = client_read(loop, cli_state,
 			&ch, sizeof(char));
 
 		if (bytes_read == 0) {
@@ -466,7 +1717,7 @@ int handle_server_write(Client &cli_state) {
     assert(cli_state.read_length > cli_state.read_completed);
 
     const char *buffer_start = cli_state.read_buffer + cli_state.read_completed;
-    int bytes_read = read(cli_state.fd,
+    int bytes_read = client_read(loop, cli_state,
             (void*) buffer_start,
             cli_state.read_length - cli_state.read_completed);
 
@@ -487,11 +1738,15 @@ int handle_server_write(Client &cli_state) {
     }
 
     cli_state.read_completed += bytes_read;
+
+    if (cli_state.limit) {
+        charge_io(loop, NULL, cli_state, bytes_read);
+    }
 	
 	bool read_finished = cli_state.read_completed == cli_state.read_length;
 
     if (cli_state.handler) {
-        cli_state.handler->on_read(cli_state, buffer_start, bytes_read);
+        CALL_HANDLER(&loop, cli_state.handler, on_read, cli_state.fd, cli_state, buffer_start, bytes_read);
     }
 
     if (read_finished) {
@@ -499,25 +1754,67 @@ int handle_server_write(Client &cli_state) {
 		cli_state.cancel_read();
 
         if (cli_state.handler) {
-            cli_state.handler->on_read_completed(cli_state);
+            CALL_HANDLER(&loop, cli_state.handler, on_read_completed, cli_state.fd, cli_state);
         }
 	}
 
 	return bytes_read;
 }
 
-void dispatch_client_event(Client &client, fd_set &read_fd_set, fd_set &write_fd_set) {
-    if (FD_ISSET(client.fd, &read_fd_set)) {
-        int status = handle_server_write(client);
+void dispatch_client_event(EventLoop &loop, Client &client, fd_set &read_fd_set, fd_set &write_fd_set) {
+    if ((client.read_write_flag & RW_STATE_RELAY) && client.is_connected) {
+        handle_relay_event(loop, client, FD_ISSET(client.fd, &read_fd_set), FD_ISSET(client.fd, &write_fd_set));
+
+        return;
+    }
+
+    if (client.handshaking()) {
+        int status = continue_handshake(loop, client);
+
+        if (status < 0) {
+            //The connection is no use to the handler
+            loop.transport->close(client.fd);
+            client.set_fd(-1);
+
+            if (client.handler) {
+                CALL_HANDLER(&loop, client.handler, on_server_connect_failed, client.fd, client);
+            }
+
+            client.reset();
+        } else if (status > 0) {
+            //The connect timeout covered the handshake
+            loop.client_info[&client - loop.client_state].deadline_usec = 0;
+
+            if (client.handler) {
+                CALL_HANDLER(&loop, client.handler, on_server_connect, client.fd, client);
+            }
+        }
+
+        return;
+    }
+
+    bool readable = FD_ISSET(client.fd, &read_fd_set);
+
+    if (readable && client.zerocopy_pending()) {
+        if (!complete_zerocopy(loop, NULL, client)) {
+            return;
+        }
+
+        //Don't mistake the error queue for a disconnect
+        readable = client.read_write_flag & RW_STATE_READ;
+    }
+
+    if (readable) {
+        int status = handle_server_write(loop, client);
         
-        if (status < 1) {
-            close(client.fd);
-            client.fd = -1;
+        if (status < 0) {
+            loop.transport->close(client.fd);
+            client.set_fd(-1);
 
             _trace("Orderly server disconnect.");
 
             if (client.handler) {
-                client.handler->on_server_disconnect(client);
+                CALL_HANDLER(&loop, client.handler, on_server_disconnect, client.fd, client);
             }
 
             client.reset();
@@ -532,64 +1829,371 @@ void dispatch_client_event(Client &client, fd_set &read_fd_set, fd_set &write_fd
     }
 
     if (FD_ISSET(client.fd, &write_fd_set)) {
-        if (client.is_connected == false) {
-            //Connection is now complete. See if it was successful
-            int valopt; 
-            socklen_t lon = sizeof(int); 
+        int status = handle_server_read(loop, client);
 
-            if (getsockopt(client.fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
-                perror("Error in getsockopt()");
+        if (status < 0) {
+            _trace("Unexpected server disconnect.");
+            
+            loop.transport->close(client.fd);
+            client.set_fd(-1);
 
-                return;
+            if (client.handler) {
+                CALL_HANDLER(&loop, client.handler, on_server_disconnect, client.fd, client);
             }
 
-            //Check the value of valopt
-            if (valopt) {
-                //Connection failed
-                _trace("Error connecting to server: %s.\n", strerror(valopt));
-                
-                close(client.fd);
-                client.fd = -1;
+            client.reset();
+        }
+    }    
+}
 
-                if (client.handler) {
-                    client.handler->on_server_connect_failed(client);
+/*
+* Starts a connection attempt to the next resolved address of an
+* outbound client. Addresses that fail right away are skipped.
+*/
+void start_connect_attempt(EventLoop &loop, int slot) {
+    Client &client = loop.client_state[slot];
+    ClientInfo &info = loop.client_info[slot];
+
+    info.next_attempt_usec = 0;
+
+    while (info.next_addr < info.num_addrs) {
+        int i = info.next_addr++;
+        int fd = loop.transport->connect((struct sockaddr*) &info.addrs[i], info.addr_lens[i]);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        set_busy_poll(loop, fd);
+
+        info.attempt_fds[info.num_attempts++] = fd;
+
+        _trace("Connection attempt %d to %s:%d. Socket: %d", i + 1, info.host, info.port, fd);
+
+        if (info.next_addr < info.num_addrs) {
+            info.next_attempt_usec = now_usec() + (uint64_t) loop.connect_stagger_ms * 1000;
+        }
+
+        break;
+    }
+
+    if (info.num_attempts > 0) {
+        client.set_fd(info.attempt_fds[0]);
+    }
+}
+
+void fail_connect(EventLoop &loop, int slot) {
+    Client &client = loop.client_state[slot];
+    ClientInfo &info = loop.client_info[slot];
+
+    for (int k = 0; k < info.num_attempts; ++k) {
+        loop.transport->close(info.attempt_fds[k]);
+    }
+
+    info.num_attempts = 0;
+    info.next_attempt_usec = 0;
+    info.deadline_usec = 0;
+
+    client.set_fd(-1);
+
+    if (client.handler) {
+        CALL_HANDLER(&loop, client.handler, on_server_connect_failed, client.fd, client);
+    }
+
+    std::shared_ptr<Relay> relay = client.relay;
+
+    client.reset();
+
+    if (relay) {
+        relay_shutdown(loop, relay);
+    }
+}
+
+void handle_connect_attempts(EventLoop &loop, int slot, fd_set &write_fd_set) {
+    Client &client = loop.client_state[slot];
+    ClientInfo &info = loop.client_info[slot];
+    int ready[MAX_CONNECT_ADDRS];
+    int num_ready = 0;
+
+    //Attempts started below reuse closed fd numbers and
+    //must not be mistaken for ready ones.
+    for (int k = 0; k < info.num_attempts; ++k) {
+        if (FD_ISSET(info.attempt_fds[k], &write_fd_set)) {
+            ready[num_ready++] = info.attempt_fds[k];
+        }
+    }
+
+    for (int r = 0; r < num_ready; ++r) {
+        int fd = ready[r];
+
+        //Connection is now complete. See if it was successful
+        int valopt = loop.transport->connect_error(fd);
+
+        if (valopt == 0) {
+            //The winner. Cancel the other attempts.
+            for (int k = 0; k < info.num_attempts; ++k) {
+                if (info.attempt_fds[k] != fd) {
+                    loop.transport->close(info.attempt_fds[k]);
                 }
+            }
+
+            info.num_attempts = 0;
+            info.next_attempt_usec = 0;
+
+            if (!info.tls) {
+                //Otherwise the deadline holds until the handshake is done
+                info.deadline_usec = 0;
+            }
+
+            client.set_fd(fd);
+            client.set_connected(true);
+            _trace("Asynchronous connection completed. Socket: %d", fd);
 
-                client.reset();
-            } else {
-                //Connection was successful
-                client.is_connected = true;
-                _trace("Asynchronous connection completed.");
+            if (info.tls) {
+                client.tls = info.tls->open_session(fd, info.host);
 
-                if (client.handler) {
-                    client.handler->on_server_connect(client);
+                if (!client.tls) {
+                    loop.transport->close(fd);
+                    fail_connect(loop, slot);
+                } else {
+                    //on_server_connect is called once the handshake is done
+                    client.sync_poll_slot();
                 }
+
+                return;
             }
-        } else {
-            int status = handle_server_read(client);
 
-            if (status < 1) {
-                _trace("Unexpected server disconnect.");
-                
-                close(client.fd);
-                client.fd = -1;
+            if (client.handler) {
+                CALL_HANDLER(&loop, client.handler, on_server_connect, client.fd, client);
+            }
+
+            if (client.relay) {
+                relay_update_flags(*client.relay);
+            }
+
+            return;
+        }
+
+        _trace("Error connecting to server: %s.", strerror(valopt > 0 ? valopt : errno));
+
+        loop.transport->close(fd);
+
+        int k = 0;
+
+        while (info.attempt_fds[k] != fd) {
+            ++k;
+        }
+
+        for (++k; k < info.num_attempts; ++k) {
+            info.attempt_fds[k - 1] = info.attempt_fds[k];
+        }
+
+        --info.num_attempts;
+
+        //Don't wait for the stagger delay to try the next address
+        start_connect_attempt(loop, slot);
+    }
+
+    if (info.num_attempts == 0) {
+        fail_connect(loop, slot);
+    } else {
+        client.set_fd(info.attempt_fds[0]);
+    }
+}
+
+void dispatch_watch_event(EventLoop &loop, Watch &w, fd_set &read_fd_set, fd_set &write_fd_set) {
+    int fd = w.fd;
 
-                if (client.handler) {
-                    client.handler->on_server_disconnect(client);
+    //The handler may unwatch the fd
+    std::shared_ptr<WatchEventHandler> handler = w.handler;
+
+    if ((w.interest & RW_STATE_READ) && FD_ISSET(fd, &read_fd_set)) {
+        CALL_HANDLER(&loop, handler, on_readable, fd, loop, fd);
+    }
+
+    if (w.fd == fd && (w.interest & RW_STATE_WRITE) && FD_ISSET(fd, &write_fd_set)) {
+        CALL_HANDLER(&loop, handler, on_writable, fd, loop, fd);
+    }
+}
+
+//Reaps zero copy completions of the clients that select() can't tell us about
+void poll_zerocopy(EventLoop &loop) {
+    for (auto& server : loop.server_state) {
+        if (!server.in_use()) {
+            continue;
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            if (server.poll_state[i].fd >= 0 && (server.poll_state[i].flags & POLL_ZEROCOPY_TIMED)) {
+                complete_zerocopy(loop, &server, server.client_state[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (loop.client_poll_state[i].fd >= 0 && (loop.client_poll_state[i].flags & POLL_ZEROCOPY_TIMED)) {
+            complete_zerocopy(loop, NULL, loop.client_state[i]);
+        }
+    }
+}
+
+//Drops accepted clients that took too long over the TLS handshake
+void expire_handshakes(EventLoop &loop, uint64_t now) {
+    for (auto& s : loop.server_state) {
+        if (!s.in_use() || !s.tls) {
+            continue;
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            auto& c = s.client_state[i];
+
+            if (!(s.poll_state[i].flags & POLL_HANDSHAKE) || c.handshake_deadline_usec == 0 || c.handshake_deadline_usec > now) {
+                continue;
+            }
+
+            _trace("TLS handshake timed out for socket: %d", c.fd);
+
+            loop.transport->close(c.fd);
+            s.remove_client_fd(c.fd);
+        }
+    }
+}
+
+//Returns the earliest time a timer is due or 0 if there are none.
+uint64_t next_timer(EventLoop &loop) {
+    uint64_t next = 0;
+
+    for (auto& t : loop.timer_state) {
+        if (t.in_use() && (next == 0 || t.expires_usec < next)) {
+            next = t.expires_usec;
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (!(loop.client_poll_state[i].flags & (POLL_CONNECTING | POLL_HANDSHAKE)) || loop.client_poll_state[i].fd < 0) {
+            continue;
+        }
+
+        auto& info = loop.client_info[i];
+
+        for (uint64_t t : {info.next_attempt_usec, info.deadline_usec}) {
+            if (t > 0 && (next == 0 || t < next)) {
+                next = t;
+            }
+        }
+    }
+
+    if (loop.handshaking_fds > 0) {
+        for (auto& s : loop.server_state) {
+            if (!s.in_use() || !s.tls) {
+                continue;
+            }
+
+            for (int i = 0; i < MAX_CLIENTS; ++i) {
+                uint64_t t = s.client_state[i].handshake_deadline_usec;
+
+                if ((s.poll_state[i].flags & POLL_HANDSHAKE) && t > 0 && (next == 0 || t < next)) {
+                    next = t;
                 }
+            }
+        }
+    }
+
+    //Wake up when a throttled client may go on
+    if (loop.throttle_wake_usec > 0 && (next == 0 || loop.throttle_wake_usec < next)) {
+        next = loop.throttle_wake_usec;
+    }
+
+    if (loop.zerocopy_timed_fds > 0) {
+        uint64_t poll = now_usec() + ZEROCOPY_POLL_USEC;
+
+        if (next == 0 || poll < next) {
+            next = poll;
+        }
+    }
+
+    return next;
+}
+
+void run_timers(EventLoop &loop) {
+    uint64_t now = now_usec();
+
+    for (int i = 0; i < MAX_TIMERS; ++i) {
+        auto& t = loop.timer_state[i];
+
+        if (!t.in_use() || t.expires_usec > now) {
+            continue;
+        }
+
+        auto handler = t.handler;
+
+        if (t.interval_usec > 0) {
+            t.expires_usec += t.interval_usec;
 
-                client.reset();
+            if (t.expires_usec <= now) {
+                //Fell behind. Don't fire the missed ticks in a burst.
+                t.expires_usec = now + t.interval_usec;
             }
+        } else {
+            //Free the slot first so that the handler can reuse it
+            t.reset();
         }
-    }    
+
+        CALL_HANDLER(&loop, handler, on_timer, -1, loop, i);
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        auto& p = loop.client_poll_state[i];
+
+        if (!(p.flags & (POLL_CONNECTING | POLL_HANDSHAKE)) || p.fd < 0) {
+            continue;
+        }
+
+        auto& info = loop.client_info[i];
+
+        if (info.deadline_usec > 0 && info.deadline_usec <= now) {
+            _trace("Timed out connecting to %s:%d", info.host, info.port);
+
+            if (p.flags & POLL_HANDSHAKE) {
+                //Connected but the handshake did not finish
+                loop.transport->close(p.fd);
+            }
+
+            fail_connect(loop, i);
+        } else if (info.next_attempt_usec > 0 && info.next_attempt_usec <= now) {
+            start_connect_attempt(loop, i);
+        }
+    }
+
+    if (loop.handshaking_fds > 0) {
+        expire_handshakes(loop, now);
+    }
+
+    if (loop.throttle_wake_usec > 0 && loop.throttle_wake_usec <= now) {
+        release_throttled(loop);
+    }
+
+    if (loop.zerocopy_timed_fds > 0) {
+        poll_zerocopy(loop);
+    }
 }
 
 void EventLoop::start() {
     continue_loop = true;
+    loop_thread = pthread_self();
+    callback_timing = slow_callback_usec > 0 || watchdog_running;
+    published_sleep_start = 0;
+
+    if (cpu >= 0) {
+        pin_thread(cpu);
+    }
+
+    //Clients pushed before the loop started
+    adopt_migrated_clients();
     
     for (auto& s : server_state) {
         if (s.in_use() && s.handler) {
-            s.handler->on_loop_start(s);
+            CALL_HANDLER(this, s.handler, on_loop_start, s.server_socket, s);
         }
     }
     
@@ -597,17 +2201,87 @@ void EventLoop::start() {
     struct timeval timeout;
     
     while (continue_loop) {
-        populate_fd_set(*this, read_fd_set, write_fd_set);
-                
-        timeout.tv_sec = idle_timeout;
-        timeout.tv_usec = 0;
-        
-        int num_events = select(
-                               FD_SETSIZE,
-                               &read_fd_set,
-                               &write_fd_set,
-                               NULL,
-                               idle_timeout > 0 ? &timeout : NULL);
+        int num_events = 0;
+
+        //Only this thread writes it
+        iterations.store(iterations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        if (spin_usec > 0) {
+            //Poll without blocking until an event shows up
+            //or the spin window is over.
+            uint64_t spin_start = now_usec();
+            uint64_t spin_now = spin_start;
+
+            do {
+                int nfds = populate_fd_set(*this, read_fd_set, write_fd_set);
+
+                timeout.tv_sec = 0;
+                timeout.tv_usec = 0;
+
+                num_events = transport->select(nfds, &read_fd_set, &write_fd_set, &timeout);
+
+                ++stats.spin_polls;
+                spin_now = now_usec();
+            } while (num_events == 0 && tls_pending_fds == 0 && spin_now - spin_start < (uint64_t) spin_usec);
+
+            stats.spin_usec += spin_now - spin_start;
+
+            if (num_events > 0) {
+                ++stats.spin_wakeups;
+            }
+        }
+
+        //Set when the wait is cut short by a timer
+        //instead of the idle timeout.
+        bool timer_wait = false;
+
+        if (num_events == 0) {
+            int nfds = populate_fd_set(*this, read_fd_set, write_fd_set);
+                    
+            timeout.tv_sec = idle_timeout;
+            timeout.tv_usec = 0;
+
+            uint64_t sleep_start = now_usec();
+            uint64_t timer = next_timer(*this);
+
+            if (timer > 0) {
+                uint64_t wait_usec = timer > sleep_start ? timer - sleep_start : 0;
+
+                if (idle_timeout <= 0 || wait_usec < (uint64_t) idle_timeout * 1000000) {
+                    timeout.tv_sec = wait_usec / 1000000;
+                    timeout.tv_usec = wait_usec % 1000000;
+                    timer_wait = true;
+                }
+            }
+
+            if (tls_pending_fds > 0) {
+                //Don't wait. There are bytes to hand out.
+                timeout.tv_sec = 0;
+                timeout.tv_usec = 0;
+                timer_wait = true;
+            }
+            
+            published_sleep_start.store(sleep_start, std::memory_order_relaxed);
+
+            num_events = transport->select(
+                                nfds,
+                                &read_fd_set,
+                                &write_fd_set,
+                                (idle_timeout > 0 || timer_wait) ? &timeout : NULL);
+
+            ++stats.sleep_polls;
+            stats.sleep_usec += now_usec() - sleep_start;
+
+            published_sleep_start.store(0, std::memory_order_relaxed);
+
+            if (num_events > 0) {
+                ++stats.sleep_wakeups;
+            }
+        }
+
+        //Every iteration, including the ones cut short below, so
+        //that the Rebalancer sees the spin time right away
+        publish_load(*this);
         
         if (num_events < 0 && errno == EINTR) {
             //A signal was handled
@@ -615,18 +2289,28 @@ void EventLoop::start() {
         }
 
         DIE(num_events, "select() failed.");
+
+        if (tls_pending_fds > 0) {
+            num_events += mark_tls_pending(*this, read_fd_set);
+        }
+
+        run_timers(*this);
         
         if (num_events == 0) {
+            if (timer_wait) {
+                continue;
+            }
+
             _trace("select() timed out.");
             for (auto& s : server_state) {                
                 if (s.in_use() && s.handler) {
-                    s.handler->on_timeout(s);
+                    CALL_HANDLER(this, s.handler, on_timeout, s.server_socket, s);
                 }
             }
 
             for (auto& c : client_state) {
                 if (c.in_use() && c.handler) {
-                    c.handler->on_timeout(c);
+                    CALL_HANDLER(this, c.handler, on_timeout, c.fd, c);
                 }
             }
             
@@ -635,50 +2319,56 @@ void EventLoop::start() {
         
         for (auto& s : server_state) {
             if (s.in_use()) {
-                dispatch_server_event(s, read_fd_set, write_fd_set);
+                dispatch_server_event(*this, s, read_fd_set, write_fd_set);
+            }
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            int fd = client_poll_state[i].fd;
+
+            if (fd < 0) {
+                continue;
+            }
+
+            if (client_poll_state[i].flags & POLL_CONNECTING) {
+                handle_connect_attempts(*this, i, write_fd_set);
+            } else if (FD_ISSET(fd, &read_fd_set) || FD_ISSET(fd, &write_fd_set)) {
+                dispatch_client_event(*this, client_state[i], read_fd_set, write_fd_set);
             }
         }
 
-        for (auto& c : client_state) {
-            if (c.in_use()) {
-                dispatch_client_event(c, read_fd_set, write_fd_set);
+        for (auto& w : watch_state) {
+            if (w.in_use()) {
+                dispatch_watch_event(*this, w, read_fd_set, write_fd_set);
             }
         }
+
+        if (shed_count.load(std::memory_order_relaxed) > 0) {
+            shed_clients();
+        }
+
+        if (draining) {
+            check_drained(*this);
+        }
     }
+
+    //A loop that is not running counts as idle
+    published_sleep_start = now_usec();
 }
 
 void Server::start(int port) {
     _trace("Starting server at port: %d", port);
 
-    int status;
-    
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
-    
-    DIE(sock, "Failed to open socket.");
-    
-    status = fcntl(sock, F_SETFL, O_NONBLOCK);
-    DIE(status, "Failed to set non blocking mode for server listener socket.");
-    
-    int reuse = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
-    
-    struct sockaddr_in addr;
-    
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    
-    status = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
-    
-    DIE(status, "Failed to bind to port.");
-    
-    _trace("Calling listen.");
-    status = listen(sock, 10);
-    _trace("listen returned.");
+    int sock = loop != NULL ? take_inherited_listener(*loop, port) : -1;
+
+    if (sock < 0) {
+        sock = transport().listen(port);
+    }
     
-    DIE(status, "Failed to listen.");
+    DIE(sock, "Failed to listen.");
     
     server_socket = sock;
+    this->port = port;
 }
 
 void Client::schedule_read(const char *buffer, size_t length) {
@@ -688,7 +2378,7 @@ void Client::schedule_read(const char *buffer, size_t length) {
     read_buffer = buffer;
     read_length = length;
     read_completed = 0;
-    read_write_flag |= RW_STATE_READ;
+    add_read_write_flag(RW_STATE_READ);
     
     _trace("Scheduling read for socket: %d", fd);
 }
@@ -700,36 +2390,94 @@ void Client::schedule_write(const char *buffer, size_t length) {
     write_buffer = buffer;
     write_length = length;
     write_completed = 0;
-    read_write_flag |= RW_STATE_WRITE;
+    add_read_write_flag(RW_STATE_WRITE);
     
     _trace("Scheduling write for socket: %d", fd);
 }
 
+void Client::schedule_write(std::shared_ptr<const void> owner, const char *buffer, size_t length) {
+    schedule_write(buffer, length);
+
+    write_owner = std::move(owner);
+}
+
 void Client::cancel_read() {
     read_buffer = NULL;
     read_length = 0;
     read_completed = 0;
-    read_write_flag &= ~RW_STATE_READ;
+    clear_read_write_flag(RW_STATE_READ);
 
     _trace("Cancel read for socket: %d", fd);
 }
 
+bool Client::start_stream(size_t initial_capacity, size_t max_capacity) {
+    assert(fd >= 0); //Bad socket?
+
+    if (read_write_flag & RW_STATE_READ) {
+        cancel_read();
+    }
+
+    stream.reset(new StreamBuffer(initial_capacity, max_capacity));
+
+    if (stream->buffer == NULL) {
+        _trace("Failed to allocate a stream buffer for socket: %d", fd);
+
+        stream.reset();
+
+        return false;
+    }
+
+    add_read_write_flag(RW_STATE_STREAM | RW_STATE_READ);
+
+    _trace("Streaming reads for socket: %d. Mirrored: %d", fd, stream->mirrored);
+
+    return true;
+}
+
+void Client::stop_stream() {
+    clear_read_write_flag(RW_STATE_STREAM | RW_STATE_READ);
+
+    stream.reset();
+
+    _trace("Stop streaming reads for socket: %d", fd);
+}
+
+void Client::consume(size_t n) {
+    if (!stream) {
+        return;
+    }
+
+    stream->consume(n);
+
+    if (!(read_write_flag & RW_STATE_READ) && !stream->full()) {
+        //Resume reading after the buffer had filled up
+        add_read_write_flag(RW_STATE_READ);
+    }
+}
+
 void Client::cancel_write() {
     write_buffer = NULL;
     write_length = 0;
     write_completed = 0;
-    read_write_flag &= ~RW_STATE_WRITE;
+    clear_read_write_flag(RW_STATE_WRITE);
+
+    //zerocopy_owners keeps it if the kernel still sends from it
+    write_owner.reset();
 
     _trace("Cancel write for socket: %d", fd);
 }
 
-void EventLoop::add_server(int port, std::shared_ptr<ServerEventHandler> handler) {
+void EventLoop::add_server(int port, std::shared_ptr<ServerEventHandler> handler, std::shared_ptr<TlsContext> tls) {
     for (auto& s : server_state) {
         if (!s.in_use()) {
             s.handler = handler;
+            s.tls = tls;
 
             s.start(port);
 
+            //Let other loops migrate clients to it
+            publish_load(*this);
+
             return;
         }
     }
@@ -739,9 +2487,11 @@ void EventLoop::end() {
     continue_loop = 0;
 }
 
-int client_make_connection(Client &cstate, const char *host, int port) {
-	_trace("Connecting to %s:%d", host, port);
-
+/*
+* Resolves the host and orders the addresses as recommended by
+* RFC 8305, alternating between address families.
+*/
+int resolve_addresses(ClientInfo &info, const char *host, int port) {
 	char port_str[128];
 
 	snprintf(port_str, sizeof(port_str), "%d", port);
@@ -749,70 +2499,462 @@ int client_make_connection(Client &cstate, const char *host, int port) {
 	struct addrinfo hints, *res;
 
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
 	int status = getaddrinfo(host, port_str, &hints, &res);
 
-	if (status < 0 || res == NULL) {
+	if (status != 0 || res == NULL) {
 		_trace("Failed to resolve address: %s", host);
 		
         return -1;
 	}
 
-	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    struct addrinfo *first[MAX_CONNECT_ADDRS], *second[MAX_CONNECT_ADDRS];
+    int num_first = 0, num_second = 0;
+    int family = res->ai_family;
 
-    if (sock < 0) {
-        _trace("Failed to open socket.");
-        
-        freeaddrinfo(res);
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == family) {
+            if (num_first < MAX_CONNECT_ADDRS) {
+                first[num_first++] = ai;
+            }
+        } else if (num_second < MAX_CONNECT_ADDRS) {
+            second[num_second++] = ai;
+        }
+    }
 
-        return -1;
+    info.num_addrs = 0;
+    info.next_addr = 0;
+
+    for (int i = 0; info.num_addrs < MAX_CONNECT_ADDRS && (i < num_first || i < num_second); ++i) {
+        for (struct addrinfo *ai : {i < num_first ? first[i] : NULL, i < num_second ? second[i] : NULL}) {
+            if (ai != NULL && info.num_addrs < MAX_CONNECT_ADDRS) {
+                memcpy(&info.addrs[info.num_addrs], ai->ai_addr, ai->ai_addrlen);
+                info.addr_lens[info.num_addrs] = ai->ai_addrlen;
+                ++info.num_addrs;
+            }
+        }
     }
 
-    //Make the socket non-blocking
-	status = fcntl(sock, F_SETFL, O_NONBLOCK);
+    //Don't need this any more
+	freeaddrinfo(res);
 
-    if (status < 0) {
-        _trace("Failed to set non blocking mode for socket.");
+    return info.num_addrs;
+}
+
+Client* EventLoop::find_client(int fd) {
+    if (fd < 0) {
+        return NULL;
+    }
+
+    for (auto& c : client_state) {
+        if (c.fd == fd) {
+            return &c;
+        }
+    }
+
+    for (auto& s : server_state) {
+        for (auto& c : s.client_state) {
+            if (c.fd == fd) {
+                return &c;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+Server* EventLoop::find_server(Client &c) {
+    for (auto& s : server_state) {
+        if (&c >= s.client_state && &c < s.client_state + MAX_CLIENTS) {
+            return &s;
+        }
+    }
+
+    //An outbound client
+    return NULL;
+}
+
+void EventLoop::disconnect_client(Client &c) {
+    if (!c.in_use()) {
+        return;
+    }
+
+    Server *s = find_server(c);
+
+    if (s != NULL) {
+        s->disconnect_client(c);
+
+        return;
+    }
+
+    _trace("Disconnecting from server: %d", c.fd);
+
+    transport->close(c.fd);
+    c.set_fd(-1);
+
+    if (c.handler) {
+        CALL_HANDLER(this, c.handler, on_server_disconnect, c.fd, c);
+    }
+
+    c.reset();
+}
+
+bool EventLoop::relay(Client &a, Client &b) {
+    if (!a.in_use() || !b.in_use() || a.relay || b.relay || &a == &b) {
+        return false;
+    }
+
+    for (Client *c : {&a, &b}) {
+        if (c->tls && !(c->tls->kernel_send && c->tls->kernel_recv)) {
+            //The relay would move encrypted bytes
+            _trace("Can not relay TLS socket: %d. The kernel does not handle its encryption.", c->fd);
+
+            return false;
+        }
+    }
+
+    auto r = std::make_shared<Relay>();
+
+    r->ends[0] = &a;
+    r->ends[1] = &b;
+    r->use_splice = false;
+
+#ifdef __linux__
+    //splice() needs real sockets
+    if (dynamic_cast<SocketTransport*>(transport.get()) != NULL) {
+        r->use_splice = true;
+
+        for (auto& ch : r->channels) {
+            if (pipe2(ch.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                _trace("Failed to create relay pipe. %s", strerror(errno));
+
+                r->use_splice = false;
+
+                break;
+            }
 
-        freeaddrinfo(res);
+            int size = fcntl(ch.pipe_fds[0], F_GETPIPE_SZ);
 
+            ch.capacity = size > 0 ? size : RELAY_BUFFER_SIZE;
+        }
+    }
+#endif
+
+    if (!r->use_splice) {
+        for (auto& ch : r->channels) {
+            ch.buffer.resize(RELAY_BUFFER_SIZE);
+            ch.capacity = RELAY_BUFFER_SIZE;
+        }
+    }
+
+    a.cancel_read();
+    a.cancel_write();
+    b.cancel_read();
+    b.cancel_write();
+
+    a.relay = r;
+    b.relay = r;
+
+    relay_update_flags(*r);
+
+    _trace("Relay between sockets: %d and %d. Splice: %d", a.fd, b.fd, r->use_splice);
+
+    return true;
+}
+
+bool EventLoop::watch(int fd, uint32_t interest, std::shared_ptr<WatchEventHandler> handler) {
+    if (fd < 0 || fd >= FD_SETSIZE || !handler) {
+        return false;
+    }
+
+    Watch *free_slot = NULL;
+
+    for (auto& w : watch_state) {
+        if (w.fd == fd) {
+            w.interest = interest;
+            w.handler = handler;
+
+            return true;
+        }
+
+        if (!w.in_use() && free_slot == NULL) {
+            free_slot = &w;
+        }
+    }
+
+    if (free_slot == NULL) {
+        //No more room
+        return false;
+    }
+
+    free_slot->fd = fd;
+    free_slot->interest = interest;
+    free_slot->handler = handler;
+
+    _trace("Watching fd: %d", fd);
+
+    return true;
+}
+
+int EventLoop::add_timer(uint64_t delay_usec, std::shared_ptr<TimerEventHandler> handler, uint64_t interval_usec) {
+    if (!handler) {
         return -1;
     }
 
-	status = connect(sock, res->ai_addr, res->ai_addrlen);
+    for (int i = 0; i < MAX_TIMERS; ++i) {
+        auto& t = timer_state[i];
 
-    //Don't need this any more
-	freeaddrinfo(res);
+        if (!t.in_use()) {
+            t.expires_usec = now_usec() + delay_usec;
+            t.interval_usec = interval_usec;
+            t.handler = handler;
 
-	if (status < 0 && errno != EINPROGRESS) {
-		perror("Failed to connect to port.");
+            return i;
+        }
+    }
 
-		close(sock);
+    //No more room
+    return -1;
+}
 
-		return -1;
-	}
+void EventLoop::cancel_timer(int timer_id) {
+    if (timer_id >= 0 && timer_id < MAX_TIMERS) {
+        timer_state[timer_id].reset();
+    }
+}
+
+void EventLoop::unwatch(int fd) {
+    for (auto& w : watch_state) {
+        if (w.in_use() && w.fd == fd) {
+            _trace("Unwatching fd: %d", fd);
+
+            w.reset();
+
+            return;
+        }
+    }
+}
+
+#ifndef __linux__
+//Write end of the signal pipe. Signals are process wide so there is one pipe.
+static int signal_pipe_fd = -1;
+
+static void write_signal_to_pipe(int signo) {
+    int saved_errno = errno;
+    unsigned char ch = signo;
+
+    write(signal_pipe_fd, &ch, 1);
+
+    errno = saved_errno;
+}
+#endif
+
+//Reads pending signals and calls their handlers
+struct SignalWatcher : public WatchEventHandler {
+    void on_readable(EventLoop &loop, int fd) {
+        while (true) {
+            int signo;
+#ifdef __linux__
+            struct signalfd_siginfo info;
+
+            if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+                return;
+            }
+
+            signo = info.ssi_signo;
+#else
+            unsigned char ch;
+
+            if (read(fd, &ch, 1) != 1) {
+                return;
+            }
+
+            signo = ch;
+#endif
+            _trace("Received signal: %d", signo);
+
+            if (signo > 0 && signo < NSIG && loop.signal_handlers[signo]) {
+                //The handler may remove itself
+                std::shared_ptr<SignalEventHandler> handler = loop.signal_handlers[signo];
+
+                CALL_HANDLER(&loop, handler, on_signal, -1, loop, signo);
+            }
+        }
+    }
+};
+
+//Points the signalfd at the signals that have handlers
+bool update_signal_fd(EventLoop &loop) {
+#ifdef __linux__
+    sigset_t mask;
+
+    sigemptyset(&mask);
+
+    for (int signo = 1; signo < NSIG; ++signo) {
+        if (loop.signal_handlers[signo]) {
+            sigaddset(&mask, signo);
+        }
+    }
+
+    int fd = signalfd(loop.signal_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0) {
+        _trace("Failed to set up signalfd. %s", strerror(errno));
+
+        return false;
+    }
+
+    loop.signal_fd = fd;
+#else
+    if (loop.signal_fd < 0) {
+        int fds[2];
+
+        if (pipe(fds) < 0) {
+            _trace("Failed to create signal pipe. %s", strerror(errno));
+
+            return false;
+        }
+
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+        signal_pipe_fd = fds[1];
+        loop.signal_fd = fds[0];
+    }
+#endif
+
+    return loop.watch(loop.signal_fd, RW_STATE_READ, std::make_shared<SignalWatcher>());
+}
+
+bool EventLoop::add_signal(int signo, std::shared_ptr<SignalEventHandler> handler) {
+    if (signo <= 0 || signo >= NSIG || !handler) {
+        return false;
+    }
+
+    bool subscribed = (bool) signal_handlers[signo];
+
+    signal_handlers[signo] = handler;
+
+    if (subscribed) {
+        return true;
+    }
+
+#ifdef __linux__
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    //Blocked signals stay pending until the signalfd is read
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+#else
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = write_signal_to_pipe;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+#endif
+
+    if (!update_signal_fd(*this)) {
+        signal_handlers[signo].reset();
 
-	cstate.fd = sock;
+        return false;
+    }
+
+#ifndef __linux__
+    sigaction(signo, &sa, NULL);
+#endif
+
+    _trace("Subscribed to signal: %d", signo);
+
+    return true;
+}
+
+void EventLoop::remove_signal(int signo) {
+    if (signo <= 0 || signo >= NSIG || !signal_handlers[signo]) {
+        return;
+    }
+
+    signal_handlers[signo].reset();
+
+#ifdef __linux__
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+#else
+    signal(signo, SIG_DFL);
+#endif
+
+    for (auto& h : signal_handlers) {
+        if (h) {
+#ifdef __linux__
+            update_signal_fd(*this);
+#endif
+            return;
+        }
+    }
 
-	return cstate.fd;
+    //No more signals. Stop watching.
+    unwatch(signal_fd);
+    close(signal_fd);
+    signal_fd = -1;
+
+#ifndef __linux__
+    close(signal_pipe_fd);
+    signal_pipe_fd = -1;
+#endif
 }
 
-int EventLoop::add_client(const char *host, int port, std::shared_ptr<ClientEventHandler> handler) {
+Client* EventLoop::add_client(const char *host, int port, HandlerRef<ClientEventHandler> handler, int connect_timeout,
+    std::shared_ptr<TlsContext> tls) {
     //Find a free client slot
-    for (auto& c : client_state) {
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        auto& c = client_state[i];
+
         if (!c.in_use()) {
             c.reset();
 
             c.handler = handler;
 
-            return client_make_connection(c, host, port);
+            auto& info = client_info[i];
+
+            info.reset();
+            snprintf(info.host, sizeof(info.host), "%s", host);
+            info.port = port;
+            info.tls = tls;
+
+            _trace("Connecting to %s:%d", host, port);
+
+            if (resolve_addresses(info, host, port) < 0) {
+                c.reset();
+
+                return NULL;
+            }
+
+            start_connect_attempt(*this, i);
+
+            if (info.num_attempts == 0) {
+                c.reset();
+
+                return NULL;
+            }
+
+            if (connect_timeout > 0) {
+                info.deadline_usec = now_usec() + (uint64_t) connect_timeout * 1000;
+            }
+
+            return &c;
         }
     }
 
     //No more room
-    return -1;
+    return NULL;
 }
 
 }
\ No newline at end of file
@@ -1,17 +1,47 @@
 #pragma once
 
 #include <memory>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <pthread.h>
 
+//These size arrays inside Server and EventLoop. Change them here and
+//rebuild the library along with the app, never with -D.
 #define MAX_CLIENTS 5
 #define MAX_SERVERS 5
+#define MAX_WATCHES 16
+#define MAX_TIMERS 16
+#define MAX_CONNECT_ADDRS 8
+#define MAX_MIGRATIONS 64
+#define MAX_SLOW_CALLBACKS 64
 
 namespace pompeii {
 struct Client;
 struct Server;
+struct EventLoop;
+struct Relay;
 
 const uint32_t RW_STATE_NONE = 0;
 const uint32_t RW_STATE_READ = 2;
 const uint32_t RW_STATE_WRITE = 4;
+const uint32_t RW_STATE_RELAY = 8; //Bytes are forwarded to a linked connection
+const uint32_t RW_STATE_STREAM = 32; //Reads go to the client's StreamBuffer without end
+
+//What Server::broadcast() does with a client that is still writing
+const int BROADCAST_SKIP_BUSY = 0; //Leave it out of this message
+const int BROADCAST_DROP_BUSY = 1; //Disconnect it
 
 struct ClientEventHandler {
     virtual void on_server_connect(Client&) {};
@@ -28,6 +58,19 @@ struct ClientEventHandler {
     virtual void on_timeout(Client&) {};
 };
 
+struct WatchEventHandler {
+    virtual void on_readable(EventLoop&, int fd) {};
+    virtual void on_writable(EventLoop&, int fd) {};
+};
+
+struct SignalEventHandler {
+    virtual void on_signal(EventLoop&, int signo) {};
+};
+
+struct TimerEventHandler {
+    virtual void on_timer(EventLoop&, int timer_id) {};
+};
+
 struct ServerEventHandler {
     virtual void on_loop_start(Server&) {};
     virtual void on_loop_end() {};
@@ -40,41 +83,547 @@ struct ServerEventHandler {
     virtual void on_write_completed(Server&, Client&) {};
 };
 
+/*
+* Readiness state of a client slot. Servers and the loop keep
+* these in a dense array next to their Client slots so that
+* building the fd sets does not have to walk the Client objects.
+* Client keeps its PollSlot in sync whenever fd, read_write_flag
+* or is_connected change, so those are only written through the
+* Client setters.
+*/
+struct PollSlot {
+    int fd;
+    uint32_t flags; //read_write_flag plus the POLL_ flags
+};
+
+const uint32_t POLL_CONNECTING = 1; //Outbound connection not yet complete
+const uint32_t POLL_ZEROCOPY = 16; //Zero copy sends wait for the kernel to release the buffer
+const uint32_t POLL_HANDSHAKE = 64; //TLS handshake in progress
+const uint32_t POLL_TLS_PENDING = 128; //The TLS session holds decrypted bytes select() can't see
+const uint32_t POLL_THROTTLED = 256; //Out of rate limit tokens
+const uint32_t POLL_ZEROCOPY_TIMED = 512; //Zero copy completions are checked on a timer
+
+/*
+* Tokens accrue at rate per second up to burst. An I/O takes its
+* tokens after the fact and may overdraw the bucket. The bucket is
+* then empty until the debt is paid back.
+*/
+struct TokenBucket {
+    double rate; //0 for no limit
+    double burst;
+    double tokens;
+    uint64_t last_usec;
+
+    TokenBucket();
+    void set(double rate, double burst);
+    void take(double n, uint64_t now);
+    //When the bucket has tokens again. 0 if it has some now.
+    uint64_t refill_usec(uint64_t now);
+};
+
+/*
+* Rate limit of a Client or of all the clients of a Server. Reads
+* and writes count against the same buckets. An op is one read or
+* write that moved bytes.
+*/
+struct RateLimit {
+    TokenBucket bytes;
+    TokenBucket ops;
+    uint64_t throttled_until; //0 when not throttled
+    uint64_t throttled_since;
+
+    //Metrics
+    uint64_t throttle_count; //Times the buckets ran dry
+    uint64_t throttled_usec; //Time spent waiting for tokens
+
+    RateLimit();
+};
+
+/*
+* TLS state of a connection. The handshake runs in the loop without
+* blocking. After it the session keys are installed in the kernel
+* (kTLS) when the kernel supports it, and the loop keeps using plain
+* reads and writes. Otherwise the loop reads and writes through the
+* session. Implemented with OpenSSL in tls.cpp.
+*/
+struct TlsSession {
+    bool handshake_done = false;
+    bool kernel_send = false; //The kernel encrypts writes
+    bool kernel_recv = false; //The kernel decrypts reads
+    uint32_t want = RW_STATE_READ; //What the handshake waits for
+
+    virtual ~TlsSession() {};
+    //Returns 1 when the handshake is done, 0 to wait for want or -1 on failure
+    virtual int handshake() = 0;
+    //Used when the kernel does not handle a direction. Return like read() and write().
+    virtual ssize_t read(void *buffer, size_t length) = 0;
+    virtual ssize_t write(const void *buffer, size_t length) = 0;
+    virtual bool pending() = 0;
+};
+
+struct TlsContext {
+    virtual ~TlsContext() {};
+    //host is checked against the server certificate. NULL for accepted connections.
+    virtual std::unique_ptr<TlsSession> open_session(int fd, const char *host) = 0;
+};
+
+/*
+* Link with -lssl -lcrypto to use these. They are left out of a
+* library built with make TLS=0. They return NULL when the files
+* can't be loaded. A client context verifies the server against
+* ca_file, or the system's CAs without one. Only an unverified
+* context skips the check, which leaves the connection open to a man
+* in the middle. Sessions turn on TCP_NODELAY for their socket.
+* TLS needs the socket transport.
+*/
+std::shared_ptr<TlsContext> make_tls_server_context(const char *cert_file, const char *key_file);
+std::shared_ptr<TlsContext> make_tls_client_context(const char *ca_file = NULL);
+std::shared_ptr<TlsContext> make_unverified_tls_client_context();
+
+/*
+* Byte queue of a client in streaming read mode. The loop appends
+* what it reads and the handler consumes from the front. Unconsumed
+* bytes are always contiguous. On Linux the ring is mapped twice
+* back to back so that it never has to move bytes. Elsewhere the
+* bytes are moved to the front when the tail runs out of room.
+* The capacity doubles when the buffer fills up and halves when it
+* drains while mostly empty.
+*/
+struct StreamBuffer {
+    char *buffer;
+    size_t capacity;
+    size_t head; //Offset of the first unconsumed byte
+    size_t length; //Unconsumed bytes
+    size_t min_capacity;
+    size_t max_capacity;
+    size_t high_water; //Most bytes held since the last shrink check
+    bool mirrored;
+    bool dispatching; //Handlers are looking at the new bytes. Shrinking waits.
+
+    StreamBuffer(size_t initial_capacity, size_t max_capacity);
+    ~StreamBuffer();
+
+    const char* data() {
+        return buffer + head;
+    }
+    size_t size() {
+        return length;
+    }
+    bool full() {
+        return length == capacity;
+    }
+
+    //Contiguous free space at the tail. Grows the buffer when it is full.
+    char* reserve(size_t &room);
+    void commit(size_t n);
+    void consume(size_t n);
+    //Gives memory back if the buffer is empty and was hardly used
+    void shrink();
+    bool resize(size_t new_capacity);
+};
+
+struct HandlerPool;
+
+/*
+* Sits in front of a handler made by EventLoop::make_handler() in the
+* loop's HandlerPool. The owner count is a plain integer because only
+* the loop's thread touches it.
+*/
+struct PooledBlock {
+    HandlerPool *pool;
+    size_t size; //Bytes taken from the pool
+    size_t count; //Owners
+    void (*destroy)(PooledBlock *block);
+};
+
+/*
+* Owning pointer to a handler. Handlers from make_handler() are
+* counted in their PooledBlock without atomic ops. Any other handler
+* is held by a std::shared_ptr, which converts implicitly.
+*/
+template <class T>
+struct HandlerRef {
+    T *ptr;
+    PooledBlock *block; //Set for pooled handlers
+    std::shared_ptr<T> shared; //Set for the others
+
+    HandlerRef() : ptr(NULL), block(NULL) {
+    }
+
+    HandlerRef(std::nullptr_t) : ptr(NULL), block(NULL) {
+    }
+
+    template <class U>
+    HandlerRef(std::shared_ptr<U> s) : ptr(s.get()), block(NULL), shared(std::move(s)) {
+    }
+
+    HandlerRef(const HandlerRef &other) : ptr(other.ptr), block(other.block), shared(other.shared) {
+        retain();
+    }
+
+    template <class U>
+    HandlerRef(const HandlerRef<U> &other) : ptr(other.ptr), block(other.block), shared(other.shared) {
+        retain();
+    }
+
+    HandlerRef(HandlerRef &&other) : ptr(other.ptr), block(other.block), shared(std::move(other.shared)) {
+        other.ptr = NULL;
+        other.block = NULL;
+    }
+
+    template <class U>
+    HandlerRef(HandlerRef<U> &&other) : ptr(other.ptr), block(other.block), shared(std::move(other.shared)) {
+        other.ptr = NULL;
+        other.block = NULL;
+    }
+
+    ~HandlerRef() {
+        release();
+    }
+
+    HandlerRef& operator=(HandlerRef other) {
+        std::swap(ptr, other.ptr);
+        std::swap(block, other.block);
+        shared.swap(other.shared);
+
+        return *this;
+    }
+
+    void reset() {
+        release();
+        shared.reset();
+    }
+
+    T* get() const {
+        return ptr;
+    }
+
+    T* operator->() const {
+        return ptr;
+    }
+
+    T& operator*() const {
+        return *ptr;
+    }
+
+    explicit operator bool() const {
+        return ptr != NULL;
+    }
+
+    //Shares ownership of the same handler as a U. Empty if it isn't one.
+    template <class U>
+    HandlerRef<U> cast() const {
+        HandlerRef<U> r;
+
+        r.ptr = dynamic_cast<U*>(ptr);
+
+        if (r.ptr != NULL) {
+            r.block = block;
+            r.retain();
+
+            if (shared) {
+                r.shared = std::shared_ptr<U>(shared, r.ptr);
+            }
+        }
+
+        return r;
+    }
+
+    void retain() {
+        if (block != NULL) {
+            ++block->count;
+        }
+    }
+
+    void release() {
+        PooledBlock *b = block;
+
+        ptr = NULL;
+        block = NULL;
+
+        if (b != NULL && --b->count == 0) {
+            b->destroy(b);
+        }
+    }
+};
+
+/*
+* Fields are ordered so that the state the loop checks for
+* a ready socket sits together at the start of the struct.
+* Metadata that is only needed by outbound clients lives in
+* ClientInfo.
+*/
 struct Client {
-	int fd;
-	const char *read_buffer;
+    //Hot readiness state. Read only, use the setters below.
+    int fd;
+    uint32_t read_write_flag;
+    bool is_connected;
     size_t read_length;
     size_t read_completed;
-    const char *write_buffer;
     size_t write_length;
     size_t write_completed;
-    char host[128];
-	int port;
-    uint32_t read_write_flag;
-    bool is_connected;
-    std::shared_ptr<ClientEventHandler> handler;
+
+    //Only touched when the socket is ready
+    const char *read_buffer;
+    const char *write_buffer;
+    std::shared_ptr<const void> write_owner; //Keeps a shared write buffer alive. May be empty.
+    HandlerRef<ClientEventHandler> handler;
+    std::shared_ptr<Relay> relay; //Set while linked by EventLoop::relay()
+    PollSlot *poll_slot;
+    size_t zerocopy_threshold; //0 when zero copy is off
+    uint32_t zerocopy_sent; //Sends made with MSG_ZEROCOPY
+    uint32_t zerocopy_completed; //Sends whose buffer the kernel released
+    bool zerocopy_timed; //Unread bytes keep the socket readable. Completions are checked on a timer.
+    //Owners of buffers the kernel may still send from, with the number of their last send
+    std::deque<std::pair<uint32_t, std::shared_ptr<const void>>> zerocopy_owners;
+    uint32_t connection_id; //Names the connection in a capture. 0 when not captured.
+    std::unique_ptr<StreamBuffer> stream; //Set in streaming read mode
+    std::unique_ptr<TlsSession> tls; //Set for TLS connections
+    uint64_t handshake_deadline_usec; //Accepted TLS clients are dropped if the handshake isn't done by then
+    std::unique_ptr<RateLimit> limit; //Set by set_rate_limit()
 
     Client();
     void reset();
+    void set_fd(int new_fd);
+    void set_connected(bool connected);
+    void set_read_write_flag(uint32_t flags);
+    void add_read_write_flag(uint32_t flags);
+    void clear_read_write_flag(uint32_t flags);
+    void sync_poll_slot();
 
     bool in_use() {
         return fd >= 0;
     }
 
+    /*
+    * Writes of at least threshold bytes are sent with MSG_ZEROCOPY.
+    * The kernel sends from the write buffer instead of copying it, so
+    * on_write_completed is delayed until the kernel releases the buffer.
+    * Smaller writes are copied as usual. This only pays off for large
+    * writes, around 10KB and up. Call it once the socket is connected.
+    * Returns false if the socket doesn't support zero copy.
+    */
+    bool enable_zerocopy(size_t threshold);
+
+    bool zerocopy_pending() {
+        return zerocopy_sent != zerocopy_completed;
+    }
+
     void schedule_read(const char *buffer, size_t length);
     void schedule_write(const char *buffer, size_t length);
+    /*
+    * Writes from a buffer kept alive by owner. The client holds on to
+    * owner until the write completes or is cancelled, so many clients
+    * can write the same buffer without copying it. With zero copy it
+    * holds on until the kernel is done with the buffer, even if the
+    * write was cancelled or followed by another one.
+    */
+    void schedule_write(std::shared_ptr<const void> owner, const char *buffer, size_t length);
     void cancel_read();
+    bool handshaking() {
+        return tls && !tls->handshake_done;
+    }
+
+    /*
+    * Limits reads and writes together to bytes_per_sec and
+    * ops_per_sec. A rate of 0 leaves that dimension unlimited and
+    * both 0 removes the limit. A burst of 0 allows a tenth of a
+    * second worth. While the limit is exceeded the loop leaves the
+    * socket alone and wakes up when tokens are back.
+    */
+    void set_rate_limit(double bytes_per_sec, double ops_per_sec, double burst_bytes = 0, double burst_ops = 0);
+
+    /*
+    * Streaming read mode. The loop keeps reading into a StreamBuffer
+    * and calls on_read with the new bytes. All unconsumed bytes are
+    * at stream_data(). The handler calls consume() when it is done
+    * with some. Reading pauses while the buffer is full at its maximum
+    * size, until the handler consumes. A scheduled read is cancelled.
+    */
+    bool start_stream(size_t initial_capacity = 16 * 1024, size_t max_capacity = 4 * 1024 * 1024);
+    void stop_stream();
+    void consume(size_t n);
+    const char* stream_data() {
+        return stream ? stream->data() : NULL;
+    }
+    size_t stream_size() {
+        return stream ? stream->size() : 0;
+    }
     void cancel_write();
+    //Empty for handlers from make_handler(). Use handler.cast<H>() for those.
     template <class H>
     std::shared_ptr<H> get_handler() {
-        return std::dynamic_pointer_cast<H>(handler);
+        return std::dynamic_pointer_cast<H>(handler.shared);
+    }
+};
+
+/*
+* Transport performs the socket calls made by the loop. It mirrors
+* the system calls it replaces: failures return -1 and set errno.
+* File descriptors handed out by a transport must be less than
+* FD_SETSIZE.
+*/
+struct Transport {
+    virtual ~Transport() {};
+    //Returns a non-blocking listener socket.
+    virtual int listen(int port) = 0;
+    //Returns a non-blocking connection or -1 with EAGAIN if none is pending.
+    virtual int accept(int listen_fd) = 0;
+    //Starts a non-blocking connect. Completion is signalled by write readiness.
+    virtual int connect(const struct sockaddr *addr, socklen_t addr_len) = 0;
+    //Returns 0 if the connection was established or an errno value if not.
+    virtual int connect_error(int fd) = 0;
+    virtual ssize_t read(int fd, void *buffer, size_t length) = 0;
+    virtual ssize_t write(int fd, const void *buffer, size_t length) = 0;
+    //Ends the stream in the write direction. The peer reads end of stream.
+    virtual int shutdown_write(int fd) = 0;
+    virtual void close(int fd) = 0;
+    virtual int select(int nfds, fd_set *read_fd_set, fd_set *write_fd_set, struct timeval *timeout) = 0;
+};
+
+//The default transport. Uses kernel sockets.
+struct SocketTransport : public Transport {
+    int listen(int port);
+    int accept(int listen_fd);
+    int connect(const struct sockaddr *addr, socklen_t addr_len);
+    int connect_error(int fd);
+    ssize_t read(int fd, void *buffer, size_t length);
+    ssize_t write(int fd, const void *buffer, size_t length);
+    int shutdown_write(int fd);
+    void close(int fd);
+    int select(int nfds, fd_set *read_fd_set, fd_set *write_fd_set, struct timeval *timeout);
+};
+
+struct MemoryEndpoint;
+
+/*
+* A transport where clients and servers of the same process exchange
+* bytes through in-process ring buffers. Connecting to a port
+* reaches the memory listener of that port. The host is ignored.
+* Data never enters the kernel which makes it suitable for deterministic
+* benchmarks and stress tests of the handler code.
+*
+* Each endpoint reserves a real file descriptor number by opening
+* /dev/null, so memory endpoints can be mixed with real descriptors
+* in the same loop. The transport is not thread safe.
+*/
+struct MemoryTransport : public Transport {
+    size_t buffer_size; //Capacity of each direction of a connection
+    size_t max_chunk; //Most bytes moved by a single read or write. 0 for no limit.
+    uint64_t latency_usec; //Delay before written bytes become readable
+    int eagain_every; //Fail every Nth read and write with EAGAIN. 0 to disable.
+
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t eagains_injected;
+
+    std::shared_ptr<MemoryEndpoint> endpoints[FD_SETSIZE];
+
+    MemoryTransport();
+    ~MemoryTransport();
+    int listen(int port);
+    int accept(int listen_fd);
+    int connect(const struct sockaddr *addr, socklen_t addr_len);
+    int connect_error(int fd);
+    ssize_t read(int fd, void *buffer, size_t length);
+    ssize_t write(int fd, const void *buffer, size_t length);
+    int shutdown_write(int fd);
+    void close(int fd);
+    int select(int nfds, fd_set *read_fd_set, fd_set *write_fd_set, struct timeval *timeout);
+    bool inject_eagain(uint64_t count);
+};
+
+//A file descriptor not owned by the loop, such as a pipe, eventfd or timerfd
+struct Watch {
+    int fd;
+    uint32_t interest; //RW_STATE_READ and/or RW_STATE_WRITE
+    std::shared_ptr<WatchEventHandler> handler;
+
+    Watch();
+    void reset();
+    bool in_use() {
+        return fd >= 0;
     }
 };
 
+struct Timer {
+    uint64_t expires_usec; //0 when the slot is free
+    uint64_t interval_usec; //0 for a one shot timer
+    std::shared_ptr<TimerEventHandler> handler;
+
+    Timer();
+    void reset();
+    bool in_use() {
+        return expires_usec > 0;
+    }
+};
+
+//Record types of a traffic capture
+const uint8_t CAPTURE_OPEN = 1; //Payload is the server port, 4 bytes
+const uint8_t CAPTURE_READ = 2; //Bytes read from the client
+const uint8_t CAPTURE_WRITE = 3; //Bytes written to the client
+const uint8_t CAPTURE_CLOSE = 4;
+
+/*
+* A record of a capture file. The file starts with the 4 byte
+* magic "PMPC" and a 4 byte version. Each record is stored as
+* usec (8 bytes), connection_id (4), type (1) and length (4) in
+* host byte order, followed by length bytes of payload.
+*/
+struct CaptureRecord {
+    uint64_t usec; //Since the capture started
+    uint32_t connection_id;
+    uint8_t type;
+    uint32_t length;
+};
+
+//Opens a capture file for reading. Returns NULL if it isn't one.
+FILE* open_capture(const char *path);
+bool read_capture_record(FILE *in, CaptureRecord &record, std::vector<char> &payload);
+
+//A handler callback that ran longer than EventLoop::slow_callback_usec
+struct SlowCallback {
+    uint64_t usec; //When it returned
+    uint64_t duration_usec;
+    const char *handler_type; //Mangled name from typeid
+    const char *callback;
+    int fd; //-1 for timers and signals
+};
+
+//Cold metadata of an outbound client
+struct ClientInfo {
+    char host[128];
+    int port;
+
+    /*
+    * Connection racing state. Resolved addresses are tried in
+    * turn, a new attempt starting every connect_stagger_ms while
+    * the earlier ones are still pending. attempt_fds[0] is
+    * also the fd of the Client.
+    */
+    struct sockaddr_storage addrs[MAX_CONNECT_ADDRS];
+    socklen_t addr_lens[MAX_CONNECT_ADDRS];
+    int num_addrs;
+    int next_addr;
+    int attempt_fds[MAX_CONNECT_ADDRS];
+    int num_attempts;
+    uint64_t next_attempt_usec; //0 if no attempt is due
+    uint64_t deadline_usec; //0 for no connect timeout. Covers the TLS handshake too.
+    std::shared_ptr<TlsContext> tls; //Handshake once connected
+
+    ClientInfo();
+    void reset();
+};
+
 struct Server {
     int server_socket;
+    int port;
+    PollSlot poll_state[MAX_CLIENTS]; //Indexed like client_state
 	Client client_state[MAX_CLIENTS];
     std::shared_ptr<ServerEventHandler> handler;
+    std::shared_ptr<TlsContext> tls; //Accepted clients handshake before on_client_connect
+    std::unique_ptr<RateLimit> limit; //Shared by all clients. Set by set_rate_limit().
+    EventLoop *loop; //Set by the owning loop. NULL for a standalone server.
 
     Server();
     ~Server();
@@ -86,26 +635,556 @@ struct Server {
     void disconnect_client(Client &c);
     bool add_client_fd(int fd);
     bool remove_client_fd(int fd);
+    //Limits the total I/O of all clients. Same arguments as Client::set_rate_limit().
+    void set_rate_limit(double bytes_per_sec, double ops_per_sec, double burst_bytes = 0, double burst_ops = 0);
+    Transport& transport();
 
     void start(int port);
+
+    /*
+    * Writes one buffer to every client of the server. The buffer is
+    * not copied. owner keeps it alive until the last client is done
+    * with it. Clients still busy with an earlier write are skipped or
+    * disconnected depending on policy. Relayed clients are skipped.
+    * Returns the number of clients the write was scheduled for.
+    */
+    int broadcast(std::shared_ptr<const void> owner, const char *buffer, size_t length, int policy = BROADCAST_SKIP_BUSY);
+
     template <class H>
     std::shared_ptr<H> get_handler() {
         return std::dynamic_pointer_cast<H>(handler);
     }
 };
 
+/*
+* Counters that show how the loop waited for events. Spin polls
+* are zero timeout polls made during the spin window. Sleep polls
+* block in the kernel until an event or timeout occurs.
+*/
+struct LoopStats {
+    uint64_t spin_polls;
+    uint64_t spin_wakeups; //Spin polls that found an event
+    uint64_t spin_usec;
+    uint64_t sleep_polls;
+    uint64_t sleep_wakeups; //Sleep polls that found an event
+    uint64_t sleep_usec;
+    uint64_t throttle_count; //Times a rate limit ran dry
+    uint64_t throttled_usec; //Time clients waited for tokens. Overlapping waits add up.
+
+    LoopStats();
+    void reset();
+    //Fraction of wakeups that were served by spinning
+    double spin_wakeup_ratio();
+    //Fraction of waiting time that was spent spinning
+    double spin_time_ratio();
+    void print(FILE *out);
+};
+
+/*
+* Bounded lock free queue with many producers and one consumer.
+* push() fails when the queue is full.
+*/
+template <class T, size_t N>
+struct MpscQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell cells[N];
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos; //Only touched by the consumer
+
+    MpscQueue() {
+        for (size_t i = 0; i < N; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos = 0;
+    }
+
+    bool push(T &&item) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        while (true) {
+            cell = &cells[pos % N];
+
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                //Full
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool pop(T &item) {
+        Cell &cell = cells[dequeue_pos % N];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+        if ((intptr_t) seq - (intptr_t) (dequeue_pos + 1) < 0) {
+            //Empty
+            return false;
+        }
+
+        item = std::move(cell.data);
+        cell.sequence.store(dequeue_pos + N, std::memory_order_release);
+        ++dequeue_pos;
+
+        return true;
+    }
+};
+
+//The state of a Client in transit between two loops
+struct ClientHandoff {
+    int server_index; //Index in server_state or -1 for an outbound client
+    int fd;
+    uint32_t read_write_flag;
+    const char *read_buffer;
+    size_t read_length;
+    size_t read_completed;
+    const char *write_buffer;
+    size_t write_length;
+    size_t write_completed;
+    std::shared_ptr<const void> write_owner;
+    std::unique_ptr<StreamBuffer> stream;
+    std::unique_ptr<RateLimit> limit;
+    std::shared_ptr<ClientEventHandler> handler;
+    size_t zerocopy_threshold;
+    char host[128];
+    int port;
+    EventLoop *source; //Takes the client back if there is no room. NULL once sent back.
+};
+
+/*
+* Recycles memory for handler objects. Blocks are kept in free lists
+* by size class and memory is taken from the global allocator in large
+* chunks only when a free list runs dry. Every block starts on a 64
+* byte boundary. Not thread safe. Only use it from the thread of the
+* loop that owns it.
+*/
+struct HandlerPool {
+    static const size_t BLOCK_SIZE = 64;
+    static const size_t NUM_SIZE_CLASSES = 16; //Blocks up to 1KB
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    FreeBlock *free_lists[NUM_SIZE_CLASSES];
+    std::vector<char*> chunks;
+    char *chunk_next; //Unused part of the newest chunk
+    char *chunk_end;
+    uint64_t allocations; //From the pool
+    uint64_t recycled; //Allocations served by a free list
+
+    HandlerPool();
+    ~HandlerPool();
+
+    void* allocate(size_t size) {
+        size_t index = (size - 1) / BLOCK_SIZE;
+
+        if (index >= NUM_SIZE_CLASSES) {
+            return ::operator new(size, std::align_val_t(BLOCK_SIZE));
+        }
+
+        ++allocations;
+
+        FreeBlock *block = free_lists[index];
+
+        if (block != NULL) {
+            free_lists[index] = block->next;
+            ++recycled;
+
+            return block;
+        }
+
+        return carve((index + 1) * BLOCK_SIZE);
+    }
+
+    void deallocate(void *p, size_t size) {
+        size_t index = (size - 1) / BLOCK_SIZE;
+
+        if (index >= NUM_SIZE_CLASSES) {
+            ::operator delete(p, std::align_val_t(BLOCK_SIZE));
+
+            return;
+        }
+
+        FreeBlock *block = (FreeBlock*) p;
+
+        block->next = free_lists[index];
+        free_lists[index] = block;
+    }
+
+    void* carve(size_t size);
+};
+
+//Where a pooled T starts after its PooledBlock
+template <class T>
+constexpr size_t pooled_offset() {
+    return (sizeof(PooledBlock) + alignof(T) - 1) / alignof(T) * alignof(T);
+}
+
+template <class T>
+void destroy_pooled(PooledBlock *block) {
+    T *object = (T*) ((char*) block + pooled_offset<T>());
+
+    object->~T();
+    block->pool->deallocate(block, block->size);
+}
+
 struct EventLoop {
+    //Set before adding servers and clients. Defaults to SocketTransport.
+    //Declared first so that it outlives the servers that close sockets.
+    std::shared_ptr<Transport> transport;
+    //Declared before the clients so that it outlives their handlers
+    HandlerPool handler_pool;
+
     Server server_state[MAX_SERVERS];
+    PollSlot client_poll_state[MAX_CLIENTS]; //Indexed like client_state
     Client client_state[MAX_CLIENTS];
+    ClientInfo client_info[MAX_CLIENTS]; //Indexed like client_state
+    Watch watch_state[MAX_WATCHES];
+    Timer timer_state[MAX_TIMERS];
+    int signal_fd; //signalfd or the read end of the signal pipe. -1 if unused.
+    std::shared_ptr<SignalEventHandler> signal_handlers[NSIG];
 
     bool continue_loop;
     int idle_timeout; //Timeout in seconds. -1 for no timeout.
+    int tls_pending_fds; //Readers with decrypted bytes waiting. Counted by populate_fd_set().
+    int zerocopy_timed_fds; //Clients with POLL_ZEROCOPY_TIMED. Counted by populate_fd_set().
+    int handshaking_fds; //Accepted clients in the TLS handshake. Counted by populate_fd_set().
+    int handshake_timeout_ms; //Accepted TLS clients must finish the handshake in this time. 0 to wait for ever.
+    uint64_t throttle_wake_usec; //When the first throttled client gets tokens back. 0 if none.
+
+    /*
+    * Low latency settings. When spin_usec is set the loop polls
+    * with a zero timeout for that many microseconds before
+    * blocking. This trades CPU for wakeup latency.
+    */
+    int spin_usec; //0 to disable spinning.
+    int busy_poll_usec; //SO_BUSY_POLL value for connections. 0 to disable.
+    int cpu; //CPU to pin the loop thread to. -1 for no pinning.
+    int connect_stagger_ms; //Delay before racing the next address of a host
+    LoopStats stats;
+
+    /*
+    * Stall diagnostics. Callbacks that take longer than
+    * slow_callback_usec are traced and kept in a ring. Set it
+    * before start(). 0 to disable. While timing is on the loop
+    * also publishes the callback it is in for the watchdog.
+    */
+    int slow_callback_usec;
+    SlowCallback slow_callbacks[MAX_SLOW_CALLBACKS];
+    uint64_t num_slow_callbacks; //Ever recorded. The ring holds the latest.
+    bool callback_timing;
+    std::atomic<const char*> current_handler_type; //NULL outside callbacks
+    std::atomic<const char*> current_callback;
+    std::atomic<int> current_fd;
+    std::atomic<uint64_t> iterations;
+    pthread_t loop_thread;
+    int watchdog_ms;
+    std::atomic<bool> watchdog_running;
+    std::atomic<uint64_t> watchdog_stalls;
+    std::thread watchdog_thread;
+
+    /*
+    * Hot restart state. Listening sockets received from an old
+    * process wait in inherited_fds until add_server() asks for
+    * their port.
+    */
+    int restart_fd; //Unix socket successors connect to. -1 if unused.
+    int inherited_fds[MAX_SERVERS];
+    int inherited_ports[MAX_SERVERS];
+    int num_inherited;
+    bool draining; //Not accepting. Ends once the clients are gone.
+    int drain_timeout_ms; //Disconnect the clients left after this. 0 to wait for ever.
+
+    //Traffic capture of accepted clients. See start_capture().
+    FILE *capture_file;
+    uint64_t capture_start_usec;
+    uint32_t next_connection_id;
+
+    /*
+    * Migration. Other loops push clients into migration_queue and
+    * wake this loop through a pipe that lives as long as the loop.
+    * The load figures are published once per iteration for the
+    * Rebalancer. Free slots are indexed like server_state, with the
+    * last one for outbound clients.
+    */
+    MpscQueue<ClientHandoff, MAX_MIGRATIONS> migration_queue;
+    int migration_pipe[2];
+    std::atomic<int> published_free[MAX_SERVERS + 1]; //Free client slots
+    std::atomic<int> migrations_queued[MAX_SERVERS + 1]; //Handoffs pushed and not adopted yet
+    std::atomic<uint64_t> published_idle_usec; //Total time spent waiting for events
+    std::atomic<uint64_t> published_sleep_start; //Set while blocked in select() or not running. 0 otherwise.
+    std::atomic<uint32_t> published_clients; //Clients in use
+    std::atomic<int> shed_count; //Clients the Rebalancer asked this loop to move
+    std::atomic<EventLoop*> shed_target;
 
     EventLoop();
+    ~EventLoop();
     void start();
     void end();
-    void add_server(int port, std::shared_ptr<ServerEventHandler> handler);
-    int add_client(const char *host, int port, std::shared_ptr<ClientEventHandler> handler);
+    //With a TlsContext accepted clients are connected once the handshake is done
+    void add_server(int port, std::shared_ptr<ServerEventHandler> handler, std::shared_ptr<TlsContext> tls = nullptr);
+
+    /*
+    * Creates a handler in the loop's HandlerPool instead of the
+    * global heap. Memory of disconnected clients' handlers is reused.
+    * Its owners are counted without atomic ops. Call this from the
+    * loop's thread, don't copy the HandlerRef to another thread and
+    * don't keep the handler beyond the life of the loop.
+    */
+    template <class T, class... Args>
+    HandlerRef<T> make_handler(Args&&... args) {
+        static_assert(alignof(T) <= HandlerPool::BLOCK_SIZE, "Pool blocks are only 64 byte aligned");
+
+        size_t size = pooled_offset<T>() + sizeof(T);
+        PooledBlock *block = (PooledBlock*) handler_pool.allocate(size);
+        HandlerRef<T> r;
+
+        block->pool = &handler_pool;
+        block->size = size;
+        block->count = 1;
+        block->destroy = destroy_pooled<T>;
+
+        r.ptr = new ((char*) block + pooled_offset<T>()) T(std::forward<Args>(args)...);
+        r.block = block;
+
+        return r;
+    }
+    /*
+    * Connects to a host asynchronously. IPv6 and IPv4 addresses of the
+    * host are raced Happy Eyeballs style. The first to connect wins and
+    * becomes the fd of the client. If no address connects within
+    * connect_timeout milliseconds on_server_connect_failed is called.
+    * A connect_timeout of 0 waits for the kernel to give up.
+    * With a TlsContext on_server_connect waits for the handshake.
+    * Returns the client or NULL. Its fd belongs to whichever attempt
+    * is current and may change until on_server_connect, but the Client
+    * stays the same. The slot is reused once on_server_connect_failed
+    * or on_server_disconnect has been called.
+    */
+    Client* add_client(const char *host, int port, HandlerRef<ClientEventHandler> handler, int connect_timeout = 0,
+        std::shared_ptr<TlsContext> tls = nullptr);
+    Client* find_client(int fd);
+    Server* find_server(Client &c);
+    void disconnect_client(Client &c);
+
+    /*
+    * Links two connections so that the bytes received by one are
+    * written to the other, in both directions. Typically a client
+    * accepted by a server and an outbound client from add_client().
+    * Pending reads and writes of both clients are cancelled. Reading
+    * stops while the other side can not keep up. When one side ends
+    * its stream the other side's write direction is shut down once
+    * everything read before has been forwarded. Both are disconnected
+    * when both directions have ended or on an error. On Linux with the socket
+    * transport bytes move through a pipe with splice() and are never
+    * copied to user space. TLS connections can only be relayed when
+    * the kernel handles both directions.
+    */
+    bool relay(Client &a, Client &b);
+
+    /*
+    * Polls a file descriptor the loop does not own alongside its
+    * sockets. Watching a fd again changes its interest and handler.
+    * The fd should be non-blocking. Unwatch it before closing it.
+    */
+    bool watch(int fd, uint32_t interest, std::shared_ptr<WatchEventHandler> handler);
+    void unwatch(int fd);
+
+    /*
+    * Calls the handler on the loop thread after delay_usec and then
+    * every interval_usec if that is not 0. Returns the timer id to
+    * cancel it with or -1 if there is no room.
+    */
+    int add_timer(uint64_t delay_usec, std::shared_ptr<TimerEventHandler> handler, uint64_t interval_usec = 0);
+    void cancel_timer(int timer_id);
+
+    /*
+    * Records the connections accepted from now on, and the bytes read
+    * from and written to them, to a capture file. tools/replay plays
+    * the file back against a server. Returns false if the file can't
+    * be created.
+    */
+    bool start_capture(const char *path);
+    void stop_capture();
+
+    /*
+    * Starts a thread that reports when the loop has spent more than
+    * stall_ms in one iteration without waiting for events. The report
+    * names the callback the loop is in and has a stack sample of the
+    * loop thread, taken with a signal. Call it before start().
+    */
+    void start_watchdog(int stall_ms);
+    void stop_watchdog();
+    void print_slow_callbacks(FILE *out);
+
+    /*
+    * Hot restart without refusing connections. The running process
+    * calls listen_for_restart() with a Unix socket path. The new
+    * process calls inherit_listeners() with the same path before
+    * add_server(). It receives the listening sockets of the old
+    * process, and add_server() uses the one with a matching port.
+    * The old process then drains: it stops accepting and its loop
+    * ends when the last client is gone or drain_timeout_ms passes.
+    *
+    * Instead of a Unix socket, the old process can exec the new one
+    * with spawn_successor(). The sockets are inherited and named in
+    * the POMPEII_LISTEN_FDS environment variable as port:fd pairs
+    * separated by commas, which inherit_listeners() reads first.
+    * spawn_successor() drains only once the exec succeeded and returns
+    * -1 otherwise. The restart socket is open to the same user only.
+    * Only the socket transport supports hot restart.
+    */
+    bool listen_for_restart(const char *path);
+    bool inherit_listeners(const char *path);
+    pid_t spawn_successor(char *const argv[]);
+    void drain();
+
+    /*
+    * Delivers a signal as a callback on the loop thread. On Linux the
+    * signal is blocked and read from a signalfd, so it never interrupts
+    * the loop. Subscribe before starting other threads so that they
+    * inherit the blocked mask. Elsewhere a handler writes the signal
+    * to a pipe watched by the loop.
+    */
+    bool add_signal(int signo, std::shared_ptr<SignalEventHandler> handler);
+    void remove_signal(int signo);
+
+    /*
+    * Moves a connected client to another loop, which may run on another
+    * thread. Call this from this loop's thread. The fd, pending read and
+    * write and the handler go to the other loop. Accepted clients join
+    * the server at the same index of server_state in the other loop.
+    * Relayed clients and clients still connecting can't be moved.
+    * The handler may be called from the other thread as soon as this
+    * returns, so it must not touch the Client afterwards. Both loops
+    * must use the socket transport. Handlers from make_handler() and
+    * clients waiting for zero copy completions can't leave the loop.
+    * Neither can TLS clients and clients waiting for rate limit tokens.
+    * A client is only moved if the other loop had a free slot when it
+    * last published its load. If the slot was taken in the meantime the
+    * client comes back to this loop. Only if this loop has no room
+    * either is it disconnected, with the usual disconnect callback.
+    * dest must outlive the call. Returns false if the client stays
+    * with this loop.
+    */
+    bool migrate(Client &c, EventLoop &dest);
+    void adopt_migrated_clients();
+    void shed_clients();
+};
+
+/*
+* Evens out core utilization among loops that run on their own
+* threads. Every interval the busiest loop is asked to move a few
+* accepted clients to the least busy loop, if their utilization
+* differs by more than threshold.
+*/
+struct Rebalancer {
+    std::vector<EventLoop*> loops;
+    int interval_ms;
+    double threshold; //Utilization difference, between 0 and 1
+    int max_moves; //Clients moved per interval
+
+    std::thread thread;
+    std::atomic<bool> running;
+
+    Rebalancer();
+    ~Rebalancer();
+    void add_loop(EventLoop &loop);
+    void start();
+    void stop();
+    void run();
+};
+
+struct MuxChannel;
+
+/*
+* Frames of a MuxChannel start with the payload length and the
+* request id, both 32 bits in network byte order. A response
+* carries the id of its request.
+*/
+const size_t MUX_HEADER_SIZE = 8;
+
+struct MuxEventHandler {
+    virtual void on_connect(MuxChannel&) {};
+    virtual void on_response(MuxChannel&, uint32_t id, const char* payload, size_t length) {};
+    virtual void on_timeout(MuxChannel&, uint32_t id) {};
+    //The connection was lost or never made before the response came
+    virtual void on_error(MuxChannel&, uint32_t id) {};
+    virtual void on_disconnect(MuxChannel&) {};
+};
+
+/*
+* Carries many concurrent requests over one outbound connection.
+* Requests are written back to back without waiting for responses.
+* Requests sent while a write is in progress go out together in the
+* next write. Responses may come in any order and are matched to
+* their request by id. A request that has no response after its
+* timeout is given up. A late response to it is dropped.
+*
+* Create it with std::make_shared and keep a reference. Requests sent
+* before the connection is made are written once it is. Don't call
+* connect() from on_disconnect(). Use a timer to reconnect.
+*/
+struct MuxChannel : public ClientEventHandler, public TimerEventHandler, public std::enable_shared_from_this<MuxChannel> {
+    EventLoop &loop;
+    std::shared_ptr<MuxEventHandler> handler;
+    Client *client; //Set while connected
+    bool connecting;
+    size_t max_frame; //Longer responses are a protocol error
+    uint32_t next_id;
+    std::string outgoing; //Frames waiting for the current write to finish
+    std::string writing; //Frames being written
+    std::multimap<uint64_t, uint32_t> deadlines; //Deadline to request id
+    //Requests waiting for a response. deadlines.end() if no timeout.
+    std::unordered_map<uint32_t, std::multimap<uint64_t, uint32_t>::iterator> pending;
+    int timer_id;
+    uint64_t timer_deadline;
+
+    MuxChannel(EventLoop &loop, std::shared_ptr<MuxEventHandler> handler, size_t max_frame = 1024 * 1024);
+
+    //Returns false if the connection could not be started
+    bool connect(const char *host, int port, int connect_timeout = 0, std::shared_ptr<TlsContext> tls = nullptr);
+    void close();
+
+    //Returns the request id or 0 when the channel is closed
+    uint32_t send(const char *payload, size_t length, uint64_t timeout_usec = 0);
+    //Forgets a request. Its response will be dropped.
+    bool cancel(uint32_t id);
+    size_t in_flight() {
+        return pending.size();
+    }
+
+    void flush();
+    void arm_timer();
+    void fail_pending();
+
+    void on_server_connect(Client &c);
+    void on_server_connect_failed(Client &c);
+    void on_server_disconnect(Client &c);
+    void on_read(Client &c, const char *buffer, int bytes_read);
+    void on_write_completed(Client &c);
+    void on_timer(EventLoop &loop, int timer_id);
 };
 
 void enable_trace(int flag);
@@ -0,0 +1,196 @@
+#include <algorithm>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+TokenBucket::TokenBucket() {
+    rate = 0;
+    burst = 0;
+    tokens = 0;
+    last_usec = 0;
+}
+
+void TokenBucket::set(double r, double b) {
+    rate = r > 0 ? r : 0;
+    burst = b > 0 ? b : rate / 10;
+
+    if (burst < 1) {
+        burst = 1;
+    }
+
+    tokens = burst;
+    last_usec = now_usec();
+}
+
+void TokenBucket::take(double n, uint64_t now) {
+    if (rate == 0) {
+        return;
+    }
+
+    tokens += rate * (now - last_usec) / 1000000.0;
+
+    if (tokens > burst) {
+        tokens = burst;
+    }
+
+    tokens -= n;
+    last_usec = now;
+}
+
+uint64_t TokenBucket::refill_usec(uint64_t now) {
+    double t = tokens + rate * (now - last_usec) / 1000000.0;
+
+    if (rate == 0 || t > 0) {
+        return 0;
+    }
+
+    //Wake up when a little more than the debt is back
+    return now + (uint64_t) ((-t + 1) * 1000000.0 / rate);
+}
+
+RateLimit::RateLimit() {
+    throttled_until = 0;
+    throttled_since = 0;
+    throttle_count = 0;
+    throttled_usec = 0;
+}
+
+static void set_limit(std::unique_ptr<RateLimit> &limit, double bytes_per_sec, double ops_per_sec, double burst_bytes, double burst_ops) {
+    if (bytes_per_sec <= 0 && ops_per_sec <= 0) {
+        limit.reset();
+
+        return;
+    }
+
+    if (!limit) {
+        limit.reset(new RateLimit());
+    }
+
+    limit->bytes.set(bytes_per_sec, burst_bytes);
+    limit->ops.set(ops_per_sec, burst_ops);
+}
+
+void Client::set_rate_limit(double bytes_per_sec, double ops_per_sec, double burst_bytes, double burst_ops) {
+    set_limit(limit, bytes_per_sec, ops_per_sec, burst_bytes, burst_ops);
+    sync_poll_slot();
+}
+
+void Server::set_rate_limit(double bytes_per_sec, double ops_per_sec, double burst_bytes, double burst_ops) {
+    set_limit(limit, bytes_per_sec, ops_per_sec, burst_bytes, burst_ops);
+}
+
+//Takes the tokens of an I/O. Returns true if the limit is now exceeded.
+static bool charge(EventLoop &loop, RateLimit &limit, size_t bytes, uint64_t now) {
+    limit.bytes.take(bytes, now);
+    limit.ops.take(1, now);
+
+    uint64_t until = std::max(limit.bytes.refill_usec(now), limit.ops.refill_usec(now));
+
+    if (until == 0) {
+        return false;
+    }
+
+    if (limit.throttled_until == 0) {
+        ++limit.throttle_count;
+        ++loop.stats.throttle_count;
+        limit.throttled_since = now;
+    }
+
+    limit.throttled_until = until;
+
+    if (loop.throttle_wake_usec == 0 || until < loop.throttle_wake_usec) {
+        loop.throttle_wake_usec = until;
+    }
+
+    return true;
+}
+
+/*
+* Called after a client read or wrote bytes. When the rate limit of
+* the client or its server is exceeded the loop leaves the client,
+* or all clients of the server, out of select() until tokens are back.
+*/
+void charge_io(EventLoop &loop, Server *server, Client &c, size_t bytes) {
+    uint64_t now = 0;
+
+    if (c.limit) {
+        now = now_usec();
+
+        if (charge(loop, *c.limit, bytes, now)) {
+            _trace("Throttling socket: %d for %lu usec", c.fd, c.limit->throttled_until - now);
+
+            c.sync_poll_slot();
+        }
+    }
+
+    if (server != NULL && server->limit) {
+        if (now == 0) {
+            now = now_usec();
+        }
+
+        bool was_throttled = server->limit->throttled_until > 0;
+
+        if (charge(loop, *server->limit, bytes, now) && !was_throttled) {
+            _trace("Throttling server on port: %d for %lu usec", server->port, server->limit->throttled_until - now);
+        }
+    }
+}
+
+static void end_wait(EventLoop &loop, RateLimit &limit, uint64_t now) {
+    limit.throttled_usec += now - limit.throttled_since;
+    loop.stats.throttled_usec += now - limit.throttled_since;
+    limit.throttled_until = 0;
+}
+
+//Lets the clients whose tokens are back into select() again
+void release_throttled(EventLoop &loop) {
+    uint64_t now = now_usec();
+    uint64_t next = 0;
+    auto check = [&](RateLimit &limit) -> bool {
+        if (limit.throttled_until == 0) {
+            return false;
+        }
+
+        if (limit.throttled_until <= now) {
+            end_wait(loop, limit, now);
+
+            return true;
+        }
+
+        if (next == 0 || limit.throttled_until < next) {
+            next = limit.throttled_until;
+        }
+
+        return false;
+    };
+
+    for (auto& s : loop.server_state) {
+        if (!s.in_use()) {
+            continue;
+        }
+
+        if (s.limit) {
+            check(*s.limit);
+        }
+
+        for (auto& c : s.client_state) {
+            if (c.limit && check(*c.limit)) {
+                c.sync_poll_slot();
+            }
+        }
+    }
+
+    for (auto& c : loop.client_state) {
+        if (c.limit && check(*c.limit)) {
+            c.sync_poll_slot();
+        }
+    }
+
+    loop.throttle_wake_usec = next;
+}
+
+}
@@ -0,0 +1,535 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "pompeii.h"
+
+extern char **environ;
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+const char *LISTEN_FDS_ENV = "POMPEII_LISTEN_FDS";
+
+//The listener handoff message. The fds travel as SCM_RIGHTS.
+struct ListenerHandoff {
+    int count;
+    int ports[MAX_SERVERS];
+};
+
+int make_unix_address(const char *path, struct sockaddr_un &addr) {
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        _trace("Restart socket path is too long: %s", path);
+
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    return 0;
+}
+
+void close_restart_channel(EventLoop &loop);
+
+//Sends the listening sockets to a successor and starts draining
+void hand_off_listeners(EventLoop &loop, int fd) {
+    ListenerHandoff h;
+    int fds[MAX_SERVERS];
+
+    h.count = 0;
+
+    for (auto& s : loop.server_state) {
+        if (s.in_use()) {
+            h.ports[h.count] = s.port;
+            fds[h.count] = s.server_socket;
+            ++h.count;
+        }
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (h.count > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(h.count * sizeof(int));
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(h.count * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, h.count * sizeof(int));
+    }
+
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    if (sendmsg(fd, &msg, flags) != sizeof(h)) {
+        _trace("Failed to hand off listeners. %s", strerror(errno));
+
+        return;
+    }
+
+    _trace("Handed off %d listeners", h.count);
+
+    loop.drain();
+}
+
+//Only a process of our own user may take the listeners
+bool same_user(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return false;
+    }
+
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        return false;
+    }
+
+    return uid == geteuid();
+#endif
+}
+
+struct RestartWatcher : public WatchEventHandler {
+    void on_readable(EventLoop &loop, int fd) {
+        int successor = accept(fd, NULL, NULL);
+
+        if (successor < 0) {
+            return;
+        }
+
+        if (!same_user(successor)) {
+            _trace("Refusing to hand off listeners to another user.");
+
+            close(successor);
+
+            return;
+        }
+
+        //A small message to a fresh Unix socket does not block
+        hand_off_listeners(loop, successor);
+
+        close(successor);
+
+        if (loop.draining) {
+            //Only one successor takes over
+            close_restart_channel(loop);
+        }
+    }
+};
+
+void close_restart_channel(EventLoop &loop) {
+    if (loop.restart_fd < 0) {
+        return;
+    }
+
+    loop.unwatch(loop.restart_fd);
+    close(loop.restart_fd);
+
+    loop.restart_fd = -1;
+}
+
+bool EventLoop::listen_for_restart(const char *path) {
+    struct sockaddr_un addr;
+
+    if (make_unix_address(path, addr) < 0) {
+        return false;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock < 0) {
+        return false;
+    }
+
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    //Take the path over from the process we replaced
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+        ::listen(sock, 1) < 0) {
+        _trace("Failed to listen for restart at %s. %s", path, strerror(errno));
+
+        close(sock);
+
+        return false;
+    }
+
+    close_restart_channel(*this);
+
+    restart_fd = sock;
+    watch(restart_fd, RW_STATE_READ, std::make_shared<RestartWatcher>());
+
+    _trace("Listening for restart at %s", path);
+
+    return true;
+}
+
+void add_inherited_listener(EventLoop &loop, int port, int fd) {
+    if (loop.num_inherited == MAX_SERVERS) {
+        close(fd);
+
+        return;
+    }
+
+    loop.inherited_ports[loop.num_inherited] = port;
+    loop.inherited_fds[loop.num_inherited] = fd;
+    ++loop.num_inherited;
+
+    _trace("Inherited listener %d for port: %d", fd, port);
+}
+
+//Reads port:fd pairs passed by spawn_successor()
+bool inherit_from_env(EventLoop &loop) {
+    const char *value = getenv(LISTEN_FDS_ENV);
+
+    if (value == NULL) {
+        return false;
+    }
+
+    std::string list(value);
+
+    //Don't pass the fds on to our own children
+    unsetenv(LISTEN_FDS_ENV);
+
+    size_t pos = 0;
+
+    while (pos < list.size()) {
+        int port, fd;
+
+        if (sscanf(list.c_str() + pos, "%d:%d", &port, &fd) == 2 && fcntl(fd, F_GETFD) >= 0) {
+            add_inherited_listener(loop, port, fd);
+        }
+
+        size_t comma = list.find(',', pos);
+
+        pos = comma == std::string::npos ? list.size() : comma + 1;
+    }
+
+    return loop.num_inherited > 0;
+}
+
+bool EventLoop::inherit_listeners(const char *path) {
+    if (inherit_from_env(*this)) {
+        return true;
+    }
+
+    struct sockaddr_un addr;
+
+    if (path == NULL || make_unix_address(path, addr) < 0) {
+        return false;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock < 0) {
+        return false;
+    }
+
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        //No process to take over from
+        _trace("No process to inherit listeners from at %s", path);
+
+        close(sock);
+
+        return false;
+    }
+
+    struct timeval timeout = {5, 0};
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ListenerHandoff h;
+    char control[CMSG_SPACE(MAX_SERVERS * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t n = recvmsg(sock, &msg, 0);
+#endif
+
+    close(sock);
+
+    //Some fds were dropped if the control message was cut short
+    bool valid = n == sizeof(h) && !(msg.msg_flags & MSG_CTRUNC) && h.count >= 0 && h.count <= MAX_SERVERS;
+
+    if (!valid) {
+        _trace("Failed to receive listeners. %s", n < 0 ? strerror(errno) : "Bad message");
+    }
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); n > 0 && cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (int i = 0; i < count; ++i) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+            if (valid && i < h.count) {
+                add_inherited_listener(*this, h.ports[i], fd);
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    return num_inherited > 0;
+}
+
+int take_inherited_listener(EventLoop &loop, int port) {
+    for (int i = 0; i < loop.num_inherited; ++i) {
+        if (loop.inherited_ports[i] != port) {
+            continue;
+        }
+
+        int fd = loop.inherited_fds[i];
+
+        --loop.num_inherited;
+        loop.inherited_ports[i] = loop.inherited_ports[loop.num_inherited];
+        loop.inherited_fds[i] = loop.inherited_fds[loop.num_inherited];
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        _trace("Using inherited listener %d for port: %d", fd, port);
+
+        return fd;
+    }
+
+    return -1;
+}
+
+//Puts back FD_CLOEXEC that spawn_successor() cleared for the exec
+void restore_cloexec(EventLoop &loop) {
+    for (auto& s : loop.server_state) {
+        if (s.in_use()) {
+            int flags = fcntl(s.server_socket, F_GETFD);
+
+            fcntl(s.server_socket, F_SETFD, flags | FD_CLOEXEC);
+        }
+    }
+}
+
+int cloexec_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    return 0;
+#endif
+}
+
+pid_t EventLoop::spawn_successor(char *const argv[]) {
+    std::string list;
+    int status_pipe[2];
+
+    //Closed by a successful exec. Carries errno if exec fails.
+    if (cloexec_pipe(status_pipe) < 0) {
+        _trace("Failed to spawn successor. %s", strerror(errno));
+
+        return -1;
+    }
+
+    for (auto& s : server_state) {
+        if (s.in_use()) {
+            if (!list.empty()) {
+                list += ",";
+            }
+
+            list += std::to_string(s.port) + ":" + std::to_string(s.server_socket);
+
+            int flags = fcntl(s.server_socket, F_GETFD);
+
+            fcntl(s.server_socket, F_SETFD, flags & ~FD_CLOEXEC);
+        }
+    }
+
+    //The child may only make async-signal-safe calls, so the
+    //environment is built here
+    std::string entry = std::string(LISTEN_FDS_ENV) + "=" + list;
+    std::vector<char*> env;
+    size_t name_length = strlen(LISTEN_FDS_ENV);
+
+    for (char **e = environ; *e != NULL; ++e) {
+        if (strncmp(*e, LISTEN_FDS_ENV, name_length) != 0 || (*e)[name_length] != '=') {
+            env.push_back(*e);
+        }
+    }
+
+    env.push_back((char*) entry.c_str());
+    env.push_back(NULL);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        _trace("Failed to spawn successor. %s", strerror(errno));
+
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        restore_cloexec(*this);
+
+        return -1;
+    }
+
+    if (pid == 0) {
+        //Keep only the listeners. A client socket held open by the
+        //child would outlive its disconnect in this process.
+        for (int fd = 3; fd < FD_SETSIZE; ++fd) {
+            bool listener = false;
+
+            for (auto& s : server_state) {
+                listener = listener || (s.in_use() && s.server_socket == fd);
+            }
+
+            if (!listener && fd != status_pipe[1]) {
+                close(fd);
+            }
+        }
+
+        //Signals may be blocked for signalfd
+        sigset_t none;
+
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        execve(argv[0], argv, env.data());
+
+        int error = errno;
+
+        if (write(status_pipe[1], &error, sizeof(error)) < 0) {
+            //Nothing left to report with
+        }
+
+        _exit(127);
+    }
+
+    close(status_pipe[1]);
+
+    int error = 0;
+    ssize_t n;
+
+    //Returns 0 once the exec closed the pipe
+    while ((n = read(status_pipe[0], &error, sizeof(error))) < 0 && errno == EINTR) {
+    }
+
+    close(status_pipe[0]);
+    restore_cloexec(*this);
+
+    if (n != 0) {
+        _trace("Failed to start successor %s. %s", argv[0], strerror(n > 0 ? error : errno));
+
+        waitpid(pid, NULL, 0);
+
+        return -1;
+    }
+
+    _trace("Spawned successor: %d", pid);
+
+    drain();
+
+    return pid;
+}
+
+//Ends the loop when the drain timeout expires
+struct DrainTimer : public TimerEventHandler {
+    void on_timer(EventLoop &loop, int timer_id) {
+        _trace("Drain timed out. Disconnecting the remaining clients.");
+
+        for (auto& s : loop.server_state) {
+            if (s.in_use()) {
+                s.disconnect_clients();
+            }
+        }
+
+        loop.end();
+    }
+};
+
+void EventLoop::drain() {
+    if (draining) {
+        return;
+    }
+
+    _trace("Draining. No longer accepting connections.");
+
+    draining = true;
+
+    if (drain_timeout_ms > 0) {
+        add_timer((uint64_t) drain_timeout_ms * 1000, std::make_shared<DrainTimer>());
+    }
+}
+
+//Called after every iteration of a draining loop
+void check_drained(EventLoop &loop) {
+    for (auto& s : loop.server_state) {
+        for (auto& p : s.poll_state) {
+            if (p.fd >= 0) {
+                return;
+            }
+        }
+    }
+
+    _trace("Drained.");
+
+    loop.end();
+}
+
+}
@@ -0,0 +1,209 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define STREAM_MIRROR 1
+#endif
+
+static size_t page_size() {
+    static size_t size = sysconf(_SC_PAGESIZE);
+
+    return size;
+}
+
+static size_t round_to_pages(size_t size) {
+    return (size + page_size() - 1) / page_size() * page_size();
+}
+
+/*
+* Maps the same memory twice, back to back. Bytes that run off
+* the end of the first copy show up at the start of it.
+*/
+static char* map_mirrored(size_t capacity) {
+#ifdef STREAM_MIRROR
+    int fd = memfd_create("pompeii-stream", MFD_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, capacity) < 0) {
+        close(fd);
+
+        return NULL;
+    }
+
+    //Reserve room for both copies so nothing else lands in between
+    char *base = (char*) mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        close(fd);
+
+        return NULL;
+    }
+
+    if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * capacity);
+        close(fd);
+
+        return NULL;
+    }
+
+    //The mappings keep the memory alive
+    close(fd);
+
+    return base;
+#else
+    return NULL;
+#endif
+}
+
+StreamBuffer::StreamBuffer(size_t initial_capacity, size_t max_capacity) {
+    buffer = NULL;
+    capacity = 0;
+    head = 0;
+    length = 0;
+    high_water = 0;
+    mirrored = false;
+    dispatching = false;
+
+#ifdef STREAM_MIRROR
+    mirrored = true;
+#endif
+
+    min_capacity = initial_capacity > 0 ? initial_capacity : 1;
+
+    if (mirrored) {
+        //The mirror works in whole pages
+        min_capacity = round_to_pages(min_capacity);
+        max_capacity = round_to_pages(max_capacity);
+    }
+
+    this->max_capacity = max_capacity > min_capacity ? max_capacity : min_capacity;
+
+    if (!resize(min_capacity) && mirrored) {
+        _trace("Failed to map a mirrored stream buffer. %s", strerror(errno));
+
+        mirrored = false;
+
+        resize(min_capacity);
+    }
+}
+
+StreamBuffer::~StreamBuffer() {
+    if (buffer == NULL) {
+        return;
+    }
+
+    if (mirrored) {
+        munmap(buffer, 2 * capacity);
+    } else {
+        free(buffer);
+    }
+}
+
+bool StreamBuffer::resize(size_t new_capacity) {
+    if (new_capacity < length) {
+        return false;
+    }
+
+    char *p = mirrored ? map_mirrored(new_capacity) : (char*) malloc(new_capacity);
+
+    if (p == NULL) {
+        return false;
+    }
+
+    if (length > 0) {
+        //The unconsumed bytes move to the front
+        memcpy(p, buffer + head, length);
+    }
+
+    if (buffer != NULL) {
+        if (mirrored) {
+            munmap(buffer, 2 * capacity);
+        } else {
+            free(buffer);
+        }
+    }
+
+    buffer = p;
+    capacity = new_capacity;
+    head = 0;
+    high_water = length;
+
+    return true;
+}
+
+char* StreamBuffer::reserve(size_t &room) {
+    if (full() && (capacity == max_capacity || !resize(capacity * 2 < max_capacity ? capacity * 2 : max_capacity))) {
+        room = 0;
+
+        return NULL;
+    }
+
+    if (mirrored) {
+        //The tail is contiguous even when it wraps around
+        room = capacity - length;
+
+        return buffer + (head + length) % capacity;
+    }
+
+    if (head + length == capacity) {
+        memmove(buffer, buffer + head, length);
+
+        head = 0;
+    }
+
+    room = capacity - head - length;
+
+    return buffer + head + length;
+}
+
+void StreamBuffer::commit(size_t n) {
+    length += n;
+
+    if (length > high_water) {
+        high_water = length;
+    }
+}
+
+void StreamBuffer::consume(size_t n) {
+    if (n > length) {
+        n = length;
+    }
+
+    length -= n;
+    head = length == 0 ? 0 : (head + n) % capacity;
+
+    //Another handler may still read the bytes just consumed
+    if (!dispatching) {
+        shrink();
+    }
+}
+
+void StreamBuffer::shrink() {
+    if (length != 0) {
+        return;
+    }
+
+    if (capacity > min_capacity && high_water < capacity / 4) {
+        //Hardly used since the last check. Give some memory back.
+        size_t half = mirrored ? round_to_pages(capacity / 2) : capacity / 2;
+
+        resize(half > min_capacity ? half : min_capacity);
+    }
+
+    high_water = 0;
+}
+
+}
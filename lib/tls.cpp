@@ -0,0 +1,272 @@
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+
+static void trace_ssl_errors(const char *what) {
+    unsigned long e;
+
+    while ((e = ERR_get_error()) != 0) {
+        char buff[256];
+
+        ERR_error_string_n(e, buff, sizeof(buff));
+        _trace("%s: %s", what, buff);
+    }
+}
+
+struct OpenSslSession : public TlsSession {
+    SSL *ssl;
+
+    OpenSslSession(SSL *s, bool server) : ssl(s) {
+        //A client speaks first
+        want = server ? RW_STATE_READ : RW_STATE_WRITE;
+    }
+
+    ~OpenSslSession() {
+        //The socket BIO does not close the fd
+        SSL_free(ssl);
+    }
+
+    //Maps an SSL failure to the return and errno of read() and write()
+    ssize_t fail(int r) {
+        switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            //errno is set by the failed call
+            return -1;
+        default:
+            trace_ssl_errors("TLS error");
+            errno = EIO;
+
+            return -1;
+        }
+    }
+
+    int handshake() {
+        ERR_clear_error();
+
+        int r = SSL_do_handshake(ssl);
+
+        if (r == 1) {
+            handshake_done = true;
+
+#ifdef BIO_get_ktls_send
+            //OpenSSL installs the keys with setsockopt(SOL_TLS) when it can
+            kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+            kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+
+            return 1;
+        }
+
+        switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            want = RW_STATE_READ;
+
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            want = RW_STATE_WRITE;
+
+            return 0;
+        default:
+            trace_ssl_errors("TLS handshake error");
+
+            return -1;
+        }
+    }
+
+    /*
+    * SSL_read() and SSL_write() handle one record at a time. Keep
+    * going until the socket would block so that the loop does not
+    * need a select() per record. A failure after some progress is
+    * reported by the next call.
+    */
+    ssize_t read(void *buffer, size_t length) {
+        size_t done = 0;
+
+        while (done < length) {
+            ERR_clear_error();
+
+            size_t left = length - done;
+            int r = SSL_read(ssl, (char*) buffer + done, left > INT_MAX ? INT_MAX : left);
+
+            if (r <= 0) {
+                return done > 0 ? (ssize_t) done : fail(r);
+            }
+
+            done += r;
+        }
+
+        return done;
+    }
+
+    ssize_t write(const void *buffer, size_t length) {
+        size_t done = 0;
+
+        while (done < length) {
+            ERR_clear_error();
+
+            size_t left = length - done;
+            int r = SSL_write(ssl, (const char*) buffer + done, left > INT_MAX ? INT_MAX : left);
+
+            if (r <= 0) {
+                return done > 0 ? (ssize_t) done : fail(r);
+            }
+
+            done += r;
+        }
+
+        return done;
+    }
+
+    bool pending() {
+        return SSL_pending(ssl) > 0;
+    }
+};
+
+struct OpenSslContext : public TlsContext {
+    SSL_CTX *ctx;
+    bool server;
+
+    OpenSslContext(SSL_CTX *c, bool s) : ctx(c), server(s) {
+    }
+
+    ~OpenSslContext() {
+        SSL_CTX_free(ctx);
+    }
+
+    std::unique_ptr<TlsSession> open_session(int fd, const char *host) {
+        SSL *ssl = SSL_new(ctx);
+
+        if (ssl == NULL || !SSL_set_fd(ssl, fd)) {
+            trace_ssl_errors("Failed to create TLS session");
+            SSL_free(ssl);
+
+            return nullptr;
+        }
+
+        int on = 1;
+
+        //Records are written whole. Nagle would hold back the last
+        //short one until the peer's delayed ACK. Documented in pompeii.h.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        if (server) {
+            SSL_set_accept_state(ssl);
+        } else {
+            SSL_set_connect_state(ssl);
+
+            if (host != NULL) {
+                SSL_set_tlsext_host_name(ssl, host);
+                SSL_set1_host(ssl, host);
+            }
+        }
+
+        return std::unique_ptr<TlsSession>(new OpenSslSession(ssl, server));
+    }
+};
+
+static SSL_CTX* new_context(const SSL_METHOD *method) {
+    SSL_CTX *ctx = SSL_CTX_new(method);
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    //Ask OpenSSL to hand the session keys to the kernel after the handshake
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    //The loop writes what it can and comes back with the rest
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+    return ctx;
+}
+
+std::shared_ptr<TlsContext> make_tls_server_context(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = new_context(TLS_server_method());
+
+    if (ctx == NULL) {
+        trace_ssl_errors("Failed to create TLS context");
+
+        return nullptr;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        trace_ssl_errors("Failed to load certificate");
+        SSL_CTX_free(ctx);
+
+        return nullptr;
+    }
+
+    //A session ticket sent after the handshake would reach a kernel
+    //reader as a control record and fail the read
+    SSL_CTX_set_num_tickets(ctx, 0);
+
+    return std::make_shared<OpenSslContext>(ctx, true);
+}
+
+std::shared_ptr<TlsContext> make_tls_client_context(const char *ca_file) {
+    SSL_CTX *ctx = new_context(TLS_client_method());
+
+    if (ctx == NULL) {
+        trace_ssl_errors("Failed to create TLS context");
+
+        return nullptr;
+    }
+
+    //Without a CA file trust the CAs of the system
+    int loaded = ca_file != NULL ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(ctx);
+
+    if (loaded != 1) {
+        trace_ssl_errors("Failed to load CA certificates");
+        SSL_CTX_free(ctx);
+
+        return nullptr;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    return std::make_shared<OpenSslContext>(ctx, false);
+}
+
+std::shared_ptr<TlsContext> make_unverified_tls_client_context() {
+    SSL_CTX *ctx = new_context(TLS_client_method());
+
+    if (ctx == NULL) {
+        trace_ssl_errors("Failed to create TLS context");
+
+        return nullptr;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    return std::make_shared<OpenSslContext>(ctx, false);
+}
+
+}
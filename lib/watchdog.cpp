@@ -0,0 +1,196 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <chrono>
+#include <mutex>
+
+#include "pompeii.h"
+
+namespace pompeii {
+
+void _trace(const char* fmt, ...);
+uint64_t now_usec();
+
+#ifdef SIGRTMIN
+#define WATCHDOG_SIGNAL (SIGRTMIN + 1)
+#else
+#define WATCHDOG_SIGNAL SIGUSR2
+#endif
+
+const int MAX_SAMPLE_FRAMES = 64;
+
+//One stack sample at a time, shared by the watchdogs of all loops
+static std::mutex sample_lock;
+static void *sample_frames[MAX_SAMPLE_FRAMES];
+static std::atomic<int> sample_depth;
+
+static void take_stack_sample(int signo) {
+    int saved_errno = errno;
+
+    sample_depth.store(backtrace(sample_frames, MAX_SAMPLE_FRAMES), std::memory_order_release);
+
+    errno = saved_errno;
+}
+
+uint64_t begin_callback(EventLoop &loop, const char *handler_type, const char *callback, int fd) {
+    loop.current_handler_type.store(handler_type, std::memory_order_relaxed);
+    loop.current_callback.store(callback, std::memory_order_relaxed);
+    loop.current_fd.store(fd, std::memory_order_relaxed);
+
+    return now_usec();
+}
+
+void end_callback(EventLoop &loop, const char *handler_type, const char *callback, int fd, uint64_t start) {
+    uint64_t now = now_usec();
+    uint64_t duration = now - start;
+
+    loop.current_handler_type.store(NULL, std::memory_order_relaxed);
+    loop.current_callback.store(NULL, std::memory_order_relaxed);
+
+    if (loop.slow_callback_usec <= 0 || duration < (uint64_t) loop.slow_callback_usec) {
+        return;
+    }
+
+    SlowCallback &s = loop.slow_callbacks[loop.num_slow_callbacks % MAX_SLOW_CALLBACKS];
+
+    s.usec = now;
+    s.duration_usec = duration;
+    s.handler_type = handler_type;
+    s.callback = callback;
+    s.fd = fd;
+
+    ++loop.num_slow_callbacks;
+
+    _trace("Slow callback %s::%s fd: %d took %lu usec", handler_type, callback, fd, duration);
+}
+
+//Prints a type name the way it appears in the source
+static void print_type(FILE *out, const char *mangled) {
+    int status;
+    char *name = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+
+    fprintf(out, "%s", status == 0 ? name : mangled);
+
+    free(name);
+}
+
+void EventLoop::print_slow_callbacks(FILE *out) {
+    uint64_t first = num_slow_callbacks > MAX_SLOW_CALLBACKS ? num_slow_callbacks - MAX_SLOW_CALLBACKS : 0;
+
+    fprintf(out, "Slow callbacks: %lu\n", num_slow_callbacks);
+
+    for (uint64_t i = first; i < num_slow_callbacks; ++i) {
+        SlowCallback &s = slow_callbacks[i % MAX_SLOW_CALLBACKS];
+
+        fprintf(out, "  %8lu usec ", s.duration_usec);
+        print_type(out, s.handler_type);
+        fprintf(out, "::%s fd: %d\n", s.callback, s.fd);
+    }
+}
+
+static void report_stall(EventLoop &loop, uint64_t stalled_usec) {
+    const char *handler_type = loop.current_handler_type.load(std::memory_order_relaxed);
+    const char *callback = loop.current_callback.load(std::memory_order_relaxed);
+
+    fprintf(stderr, "Loop stalled for %lu ms in ", stalled_usec / 1000);
+
+    if (handler_type != NULL && callback != NULL) {
+        print_type(stderr, handler_type);
+        fprintf(stderr, "::%s fd: %d\n", callback, loop.current_fd.load(std::memory_order_relaxed));
+    } else {
+        fprintf(stderr, "the loop itself\n");
+    }
+
+    std::lock_guard<std::mutex> guard(sample_lock);
+
+    sample_depth.store(-1);
+
+    if (pthread_kill(loop.loop_thread, WATCHDOG_SIGNAL) != 0) {
+        return;
+    }
+
+    //Give the loop thread a moment to run the signal handler
+    for (int i = 0; i < 100 && sample_depth.load(std::memory_order_acquire) < 0; ++i) {
+        usleep(1000);
+    }
+
+    int depth = sample_depth.load(std::memory_order_acquire);
+
+    if (depth > 0) {
+        fprintf(stderr, "Stack of the loop thread:\n");
+        fflush(stderr);
+
+        backtrace_symbols_fd(sample_frames, depth, fileno(stderr));
+    }
+}
+
+static void run_watchdog(EventLoop *loop) {
+    uint64_t last_iterations = loop->iterations.load(std::memory_order_relaxed);
+    uint64_t last_progress = now_usec();
+    uint64_t stall_usec = (uint64_t) loop->watchdog_ms * 1000;
+    int check_ms = loop->watchdog_ms / 4 > 0 ? loop->watchdog_ms / 4 : 1;
+    bool reported = false;
+
+    while (loop->watchdog_running.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(check_ms));
+
+        uint64_t iterations = loop->iterations.load(std::memory_order_relaxed);
+        uint64_t now = now_usec();
+
+        //Blocking in select() means the loop is idle, not stuck
+        if (iterations != last_iterations || loop->published_sleep_start.load(std::memory_order_relaxed) > 0) {
+            last_iterations = iterations;
+            last_progress = now;
+            reported = false;
+
+            continue;
+        }
+
+        if (!reported && now - last_progress >= stall_usec) {
+            //Report each stall once
+            reported = true;
+            ++loop->watchdog_stalls;
+
+            report_stall(*loop, now - last_progress);
+        }
+    }
+}
+
+void EventLoop::start_watchdog(int stall_ms) {
+    if (watchdog_running || stall_ms <= 0) {
+        return;
+    }
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = take_stack_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(WATCHDOG_SIGNAL, &sa, NULL);
+
+    //The first call loads libgcc. Don't let that happen in the signal handler.
+    void *frame;
+    backtrace(&frame, 1);
+
+    watchdog_ms = stall_ms;
+    watchdog_running = true;
+    callback_timing = true;
+    watchdog_thread = std::thread(run_watchdog, this);
+
+    _trace("Watchdog started. Stall threshold: %d ms", stall_ms);
+}
+
+void EventLoop::stop_watchdog() {
+    watchdog_running = false;
+
+    if (watchdog_thread.joinable()) {
+        watchdog_thread.join();
+    }
+}
+
+}
@@ -65,7 +65,7 @@ struct MyServer : public pompeii::ServerEventHandler {
     void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
         printf("Client connected. Socket: %d\n", c.fd);
 
-        auto mc = std::make_shared<MyClient>();
+        auto mc = loop.make_handler<MyClient>();
 
         c.handler = mc;
 
@@ -0,0 +1,105 @@
+#include <pompeii.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+
+/*
+* Echo benchmark over the in-process memory transport. The rate
+* depends on the machine and on the build, so it prints the settings
+* next to the result rather than relying on a quoted figure.
+* Usage: test3 [round_trips] [max_chunk] [latency_usec] [eagain_every]
+*/
+
+const size_t MESSAGE_SIZE = 16;
+
+struct EchoClient : public pompeii::ClientEventHandler {
+    char buff[MESSAGE_SIZE];
+
+    void on_read_completed(pompeii::Server& s, pompeii::Client& c) {
+        c.schedule_write(buff, sizeof(buff));
+    }
+    void on_write_completed(pompeii::Server& s, pompeii::Client& c) {
+        c.schedule_read(buff, sizeof(buff));
+    }
+};
+
+struct EchoServer : public pompeii::ServerEventHandler {
+    void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
+        auto ec = std::make_shared<EchoClient>();
+
+        c.handler = ec;
+
+        c.schedule_read(ec->buff, sizeof(ec->buff));
+    }
+};
+
+struct Driver : public pompeii::ClientEventHandler {
+    pompeii::EventLoop& loop;
+    int round_trips;
+    int completed = 0;
+    char out[MESSAGE_SIZE];
+    char in[MESSAGE_SIZE];
+
+    Driver(pompeii::EventLoop& l, int n) : loop(l), round_trips(n) {
+        memcpy(out, "0123456789abcdef", sizeof(out));
+    }
+    void on_server_connect(pompeii::Client& c) {
+        c.schedule_write(out, sizeof(out));
+    }
+    void on_server_connect_failed(pompeii::Client& c) {
+        printf("Failed to connect.\n");
+
+        loop.end();
+    }
+    void on_write_completed(pompeii::Client& c) {
+        c.schedule_read(in, sizeof(in));
+    }
+    void on_read_completed(pompeii::Client& c) {
+        if (memcmp(in, out, sizeof(in)) != 0) {
+            printf("Echo mismatch.\n");
+
+            exit(1);
+        }
+
+        if (++completed == round_trips) {
+            loop.end();
+        } else {
+            c.schedule_write(out, sizeof(out));
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    int round_trips = argc > 1 ? atoi(argv[1]) : 1000000;
+    auto transport = std::make_shared<pompeii::MemoryTransport>();
+
+    transport->max_chunk = argc > 2 ? atoi(argv[2]) : 0;
+    transport->latency_usec = argc > 3 ? atoi(argv[3]) : 0;
+    transport->eagain_every = argc > 4 ? atoi(argv[4]) : 0;
+
+    pompeii::EventLoop loop;
+
+    loop.transport = transport;
+
+    loop.add_server(9080, std::make_shared<EchoServer>());
+
+    auto driver = std::make_shared<Driver>(loop, round_trips);
+
+    loop.add_client("127.0.0.1", 9080, driver);
+
+    auto start = std::chrono::steady_clock::now();
+
+    loop.start();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%d byte messages, max chunk: %zu latency: %llu usec EAGAIN every: %d\n",
+        (int) MESSAGE_SIZE, transport->max_chunk,
+        (unsigned long long) transport->latency_usec, transport->eagain_every);
+    printf("%d round trips in %.3f sec. %.0f messages/sec\n",
+        driver->completed, elapsed.count(), 2 * driver->completed / elapsed.count());
+    printf("Reads: %llu writes: %llu injected EAGAIN: %llu\n",
+        (unsigned long long) transport->reads,
+        (unsigned long long) transport->writes,
+        (unsigned long long) transport->eagains_injected);
+}
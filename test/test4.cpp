@@ -0,0 +1,118 @@
+#include <pompeii.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <chrono>
+
+/*
+* TLS echo over loopback. The handshake runs in the loop. Then the
+* kernel does the encryption if it supports kTLS, otherwise OpenSSL.
+* Make the self-signed cert.pem and key.pem with "make cert.pem".
+* Usage: test4 [round_trips] [message_size]
+*/
+
+struct EchoClient : public pompeii::ClientEventHandler {
+    std::vector<char> buff;
+
+    EchoClient(size_t size) : buff(size) {
+    }
+    void on_read_completed(pompeii::Server& s, pompeii::Client& c) {
+        c.schedule_write(buff.data(), buff.size());
+    }
+    void on_write_completed(pompeii::Server& s, pompeii::Client& c) {
+        c.schedule_read(buff.data(), buff.size());
+    }
+};
+
+struct EchoServer : public pompeii::ServerEventHandler {
+    size_t message_size;
+
+    EchoServer(size_t size) : message_size(size) {
+    }
+    void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
+        printf("Server handshake done. Kernel send: %d receive: %d\n",
+            c.tls->kernel_send, c.tls->kernel_recv);
+
+        auto ec = std::make_shared<EchoClient>(message_size);
+
+        c.handler = ec;
+
+        c.schedule_read(ec->buff.data(), ec->buff.size());
+    }
+};
+
+struct Driver : public pompeii::ClientEventHandler {
+    pompeii::EventLoop& loop;
+    int round_trips;
+    int completed = 0;
+    std::vector<char> out;
+    std::vector<char> in;
+
+    Driver(pompeii::EventLoop& l, int n, size_t size) : loop(l), round_trips(n), out(size), in(size) {
+        for (size_t i = 0; i < size; ++i) {
+            out[i] = 'a' + i % 26;
+        }
+    }
+    void on_server_connect(pompeii::Client& c) {
+        printf("Client handshake done. Kernel send: %d receive: %d\n",
+            c.tls->kernel_send, c.tls->kernel_recv);
+
+        c.schedule_write(out.data(), out.size());
+    }
+    void on_server_connect_failed(pompeii::Client& c) {
+        printf("Failed to connect.\n");
+
+        loop.end();
+    }
+    void on_write_completed(pompeii::Client& c) {
+        c.schedule_read(in.data(), in.size());
+    }
+    void on_read_completed(pompeii::Client& c) {
+        if (in != out) {
+            printf("Echo mismatch.\n");
+
+            exit(1);
+        }
+
+        if (++completed == round_trips) {
+            loop.end();
+        } else {
+            c.schedule_write(out.data(), out.size());
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    int round_trips = argc > 1 ? atoi(argv[1]) : 10000;
+    size_t message_size = argc > 2 ? atoi(argv[2]) : 100000;
+
+    auto server_tls = pompeii::make_tls_server_context("cert.pem", "key.pem");
+    //The self-signed certificate is its own CA
+    auto client_tls = pompeii::make_tls_client_context("cert.pem");
+
+    if (!server_tls || !client_tls) {
+        printf("Failed to load cert.pem and key.pem.\n");
+
+        return 1;
+    }
+
+    pompeii::EventLoop loop;
+
+    loop.add_server(9443, std::make_shared<EchoServer>(message_size), server_tls);
+
+    auto driver = std::make_shared<Driver>(loop, round_trips, message_size);
+
+    loop.add_client("localhost", 9443, driver, 5000, client_tls);
+
+    auto start = std::chrono::steady_clock::now();
+
+    loop.start();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%d round trips of %zu bytes in %.3f sec. %.1f MB/sec\n",
+        driver->completed, message_size, elapsed.count(),
+        2.0 * driver->completed * message_size / elapsed.count() / 1e6);
+
+    return driver->completed == round_trips ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+#include <pompeii.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+* Readiness scan microbenchmark. Walks slots the way populate_fd_set
+* does, once over the Client objects and once over the dense PollSlot
+* array, and reports time and cache misses per scan. The caches are
+* flushed before every scan, as they would be after a busy iteration.
+* Cache misses are read from perf and show as n/a when it is not allowed
+* or not on Linux.
+* Usage: test5 [slots] [scans] [ready_every]
+*/
+
+#ifdef __linux__
+static int open_miss_counter() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counter(int counter) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void stop_counter(int counter) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+}
+#else
+static int open_miss_counter() {
+    return -1;
+}
+
+static void start_counter(int counter) {
+}
+
+static void stop_counter(int counter) {
+}
+#endif
+
+struct Result {
+    double usec;
+    double misses;
+};
+
+static std::vector<char> scratch(64 * 1024 * 1024);
+
+static void flush_caches() {
+    for (size_t i = 0; i < scratch.size(); i += 64) {
+        scratch[i]++;
+    }
+}
+
+template <typename Scan>
+static Result measure(int counter, int scans, Scan scan) {
+    Result r = {0, 0};
+
+    for (int i = 0; i < scans; ++i) {
+        flush_caches();
+
+        long long misses = 0;
+
+        if (counter >= 0) {
+            start_counter(counter);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        scan();
+
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (counter >= 0) {
+            stop_counter(counter);
+
+            if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+                misses = 0;
+            }
+        }
+
+        r.usec += elapsed.count();
+        r.misses += misses;
+    }
+
+    r.usec /= scans;
+    r.misses /= scans;
+
+    return r;
+}
+
+static void report(const char *name, int counter, Result r) {
+    if (counter >= 0) {
+        printf("%-8s %8.1f usec %10.0f cache misses per scan\n", name, r.usec, r.misses);
+    } else {
+        printf("%-8s %8.1f usec %10s cache misses per scan\n", name, r.usec, "n/a");
+    }
+}
+
+int main(int argc, char **argv) {
+    int slots = argc > 1 ? atoi(argv[1]) : 10000;
+    int scans = argc > 2 ? atoi(argv[2]) : 100;
+    int ready_every = argc > 3 ? atoi(argv[3]) : 100;
+
+    std::vector<pompeii::Client> clients(slots);
+    std::vector<pompeii::PollSlot> poll_slots(slots);
+
+    for (int i = 0; i < slots; ++i) {
+        clients[i].poll_slot = &poll_slots[i];
+        clients[i].set_fd(i);
+        clients[i].set_connected(true);
+
+        if (i % ready_every == 0) {
+            clients[i].set_read_write_flag(pompeii::RW_STATE_READ);
+        }
+    }
+
+    int counter = open_miss_counter();
+    volatile int found = 0;
+
+    Result by_client = measure(counter, scans, [&]() {
+        int n = 0;
+
+        for (auto& c : clients) {
+            if (c.in_use() && (c.read_write_flag & (pompeii::RW_STATE_READ | pompeii::RW_STATE_WRITE))) {
+                ++n;
+            }
+        }
+
+        found = n;
+    });
+
+    Result by_slot = measure(counter, scans, [&]() {
+        int n = 0;
+
+        for (auto& p : poll_slots) {
+            if (p.fd >= 0 && (p.flags & (pompeii::RW_STATE_READ | pompeii::RW_STATE_WRITE))) {
+                ++n;
+            }
+        }
+
+        found = n;
+    });
+
+    printf("%d slots, %d ready. Client is %zu bytes, PollSlot is %zu bytes\n",
+        slots, (int) found, sizeof(pompeii::Client), sizeof(pompeii::PollSlot));
+    report("Client", counter, by_client);
+    report("PollSlot", counter, by_slot);
+
+    if (counter >= 0) {
+        close(counter);
+    }
+}
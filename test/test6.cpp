@@ -0,0 +1,122 @@
+#include <pompeii.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+
+/*
+* Relay through a proxy to a slow reader. The origin sends a block and
+* closes right away. The reader takes a small chunk per millisecond,
+* so most of the block is still in the relay when the origin closes.
+* Every byte has to arrive before the reader sees the disconnect.
+* Usage: test6 [use_memory_transport, default 1] [bytes]
+*/
+
+const int READER_PORT = 9090;
+const int PROXY_PORT = 9091;
+const size_t READ_CHUNK = 16 * 1024;
+
+static std::vector<char> block;
+
+static char pattern(size_t i) {
+    return (char) (i * 7 + i / 251);
+}
+
+struct Origin : public pompeii::ClientEventHandler {
+    pompeii::EventLoop& loop;
+
+    Origin(pompeii::EventLoop& l) : loop(l) {
+    }
+    void on_server_connect(pompeii::Client& c) {
+        c.schedule_write(block.data(), block.size());
+    }
+    void on_server_connect_failed(pompeii::Client& c) {
+        printf("Failed to connect.\n");
+
+        exit(1);
+    }
+    void on_write_completed(pompeii::Client& c) {
+        loop.disconnect_client(c);
+    }
+};
+
+struct ProxyServer : public pompeii::ServerEventHandler {
+    pompeii::EventLoop& loop;
+
+    ProxyServer(pompeii::EventLoop& l) : loop(l) {
+    }
+    void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
+        pompeii::Client *downstream = loop.add_client("127.0.0.1", READER_PORT, std::make_shared<pompeii::ClientEventHandler>());
+
+        if (downstream == NULL || !loop.relay(c, *downstream)) {
+            printf("Failed to set up the relay.\n");
+
+            exit(1);
+        }
+    }
+};
+
+struct SlowReader : public pompeii::ServerEventHandler, public pompeii::TimerEventHandler {
+    pompeii::EventLoop& loop;
+    pompeii::Client *client = NULL;
+    char buff[READ_CHUNK];
+    size_t received = 0;
+    bool intact = true;
+
+    SlowReader(pompeii::EventLoop& l) : loop(l) {
+    }
+    void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
+        client = &c;
+
+        c.schedule_read(buff, sizeof(buff));
+    }
+    void on_read(pompeii::Server& s, pompeii::Client& c, const char *buffer, int bytes_read) {
+        for (int i = 0; i < bytes_read; ++i) {
+            intact = intact && buffer[i] == pattern(received + i);
+        }
+
+        received += bytes_read;
+
+        //Take a break before the next chunk
+        c.cancel_read();
+        loop.add_timer(1000, std::dynamic_pointer_cast<pompeii::TimerEventHandler>(s.handler));
+    }
+    void on_timer(pompeii::EventLoop& l, int timer_id) {
+        if (client != NULL) {
+            client->schedule_read(buff, sizeof(buff));
+        }
+    }
+    void on_client_disconnect(pompeii::Server& s, pompeii::Client& c) {
+        client = NULL;
+
+        loop.end();
+    }
+};
+
+int main(int argc, char **argv) {
+    bool memory = argc > 1 ? atoi(argv[1]) != 0 : true;
+    size_t bytes = argc > 2 ? atoi(argv[2]) : 1024 * 1024;
+
+    block.resize(bytes);
+
+    for (size_t i = 0; i < bytes; ++i) {
+        block[i] = pattern(i);
+    }
+
+    pompeii::EventLoop loop;
+
+    if (memory) {
+        loop.transport = std::make_shared<pompeii::MemoryTransport>();
+    }
+
+    auto reader = std::make_shared<SlowReader>(loop);
+
+    loop.add_server(READER_PORT, reader);
+    loop.add_server(PROXY_PORT, std::make_shared<ProxyServer>(loop));
+    loop.add_client("127.0.0.1", PROXY_PORT, std::make_shared<Origin>(loop));
+
+    loop.start();
+
+    printf("Received %zu of %zu bytes. Intact: %s\n", reader->received, bytes, reader->intact ? "Y" : "N");
+
+    return reader->received == bytes && reader->intact ? 0 : 1;
+}
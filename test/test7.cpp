@@ -0,0 +1,241 @@
+#include <pompeii.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+* MuxChannel requests against a backend that answers each batch in
+* reverse order. Requests starting with "drop" get no answer and must
+* time out. Some requests are cancelled right after they are sent and
+* must get no callback at all. The ids wrap around 2^32 on the way and
+* must skip a request that is still waiting. Then the backend closes
+* with requests in flight, which must all fail.
+* Usage: test7 [use_memory_transport, default 1] [requests]
+*/
+
+const int BACKEND_PORT = 9092;
+const uint64_t TIMEOUT_USEC = 200000;
+
+struct Backend : public pompeii::ClientEventHandler {
+    pompeii::EventLoop& loop;
+    std::string outgoing, writing;
+
+    Backend(pompeii::EventLoop& l) : loop(l) {
+    }
+    void flush(pompeii::Client& c) {
+        if (outgoing.empty() || (c.read_write_flag & pompeii::RW_STATE_WRITE)) {
+            return;
+        }
+
+        writing.swap(outgoing);
+        outgoing.clear();
+
+        c.schedule_write(writing.data(), writing.size());
+    }
+    void on_read(pompeii::Server& s, pompeii::Client& c, const char *buffer, int bytes_read) {
+        std::vector<std::string> frames;
+
+        while (c.stream_size() >= pompeii::MUX_HEADER_SIZE) {
+            uint32_t header[2];
+
+            memcpy(header, c.stream_data(), pompeii::MUX_HEADER_SIZE);
+
+            size_t length = ntohl(header[0]);
+
+            if (c.stream_size() < pompeii::MUX_HEADER_SIZE + length) {
+                break;
+            }
+
+            std::string request(c.stream_data() + pompeii::MUX_HEADER_SIZE, length);
+
+            c.consume(pompeii::MUX_HEADER_SIZE + length);
+
+            if (request == "bye") {
+                loop.disconnect_client(c);
+
+                return;
+            }
+
+            if (request.compare(0, 4, "drop") == 0 || request.compare(0, 4, "hold") == 0) {
+                continue;
+            }
+
+            std::string response = "re:" + request;
+            uint32_t response_header[2] = {htonl((uint32_t) response.size()), header[1]};
+
+            frames.push_back(std::string((const char*) response_header, pompeii::MUX_HEADER_SIZE) + response);
+        }
+
+        std::reverse(frames.begin(), frames.end());
+
+        for (auto& f : frames) {
+            outgoing += f;
+        }
+
+        flush(c);
+    }
+    void on_write_completed(pompeii::Server& s, pompeii::Client& c) {
+        writing.clear();
+
+        flush(c);
+    }
+};
+
+struct BackendServer : public pompeii::ServerEventHandler {
+    pompeii::EventLoop& loop;
+
+    BackendServer(pompeii::EventLoop& l) : loop(l) {
+    }
+    void on_client_connect(pompeii::Server& s, pompeii::Client& c) {
+        c.handler = std::make_shared<Backend>(loop);
+        c.start_stream();
+    }
+};
+
+struct Request {
+    int seq;
+    std::string body;
+    bool cancelled;
+};
+
+struct Caller : public pompeii::MuxEventHandler {
+    pompeii::EventLoop& loop;
+    std::unordered_map<uint32_t, Request> requests;
+    int expected = 0; //Answers or timeouts before the backend is told to close
+    int held = 0;
+    int responses = 0, timeouts = 0, errors = 0, bad = 0;
+    int last_seq = -1;
+    bool out_of_order = false;
+    bool closing = false;
+
+    Caller(pompeii::EventLoop& l) : loop(l) {
+    }
+    uint32_t send(pompeii::MuxChannel& m, int seq, const std::string& body, uint64_t timeout) {
+        uint32_t id = m.send(body.data(), body.size(), timeout);
+
+        if (id == 0 || requests.count(id) > 0) {
+            printf("Bad request id: %u\n", id);
+
+            ++bad;
+        }
+
+        requests[id] = {seq, body, false};
+
+        return id;
+    }
+    void check_done(pompeii::MuxChannel& m) {
+        if (closing || responses + timeouts < expected) {
+            return;
+        }
+
+        closing = true;
+
+        //These are in flight when the backend closes
+        for (int i = 0; i < 10; ++i) {
+            send(m, expected + i, "hold " + std::to_string(i), 0);
+            ++held;
+        }
+
+        send(m, expected + 10, "bye", 0);
+        ++held;
+    }
+    void on_response(pompeii::MuxChannel& m, uint32_t id, const char *payload, size_t length) {
+        auto it = requests.find(id);
+
+        if (it == requests.end() || it->second.cancelled || std::string(payload, length) != "re:" + it->second.body) {
+            ++bad;
+        } else {
+            out_of_order = out_of_order || it->second.seq < last_seq;
+            last_seq = it->second.seq;
+        }
+
+        ++responses;
+
+        check_done(m);
+    }
+    void on_timeout(pompeii::MuxChannel& m, uint32_t id) {
+        auto it = requests.find(id);
+
+        if (it == requests.end() || it->second.cancelled || it->second.body.compare(0, 4, "drop") != 0) {
+            ++bad;
+        }
+
+        ++timeouts;
+
+        check_done(m);
+    }
+    void on_error(pompeii::MuxChannel& m, uint32_t id) {
+        auto it = requests.find(id);
+
+        if (it == requests.end() || it->second.cancelled) {
+            ++bad;
+        }
+
+        ++errors;
+    }
+    void on_disconnect(pompeii::MuxChannel& m) {
+        loop.end();
+    }
+};
+
+int main(int argc, char **argv) {
+    bool memory = argc > 1 ? atoi(argv[1]) != 0 : true;
+    int count = argc > 2 ? atoi(argv[2]) : 5000;
+
+    pompeii::EventLoop loop;
+
+    if (memory) {
+        loop.transport = std::make_shared<pompeii::MemoryTransport>();
+    }
+
+    loop.add_server(BACKEND_PORT, std::make_shared<BackendServer>(loop));
+
+    auto caller = std::make_shared<Caller>(loop);
+    auto channel = std::make_shared<pompeii::MuxChannel>(loop, caller);
+
+    if (!channel->connect("127.0.0.1", BACKEND_PORT)) {
+        printf("Failed to connect.\n");
+
+        return 1;
+    }
+
+    //Waits until the backend closes and must keep its id
+    caller->send(*channel, -1, "hold", 0);
+    ++caller->held;
+
+    //Wrap the ids halfway through
+    channel->next_id = UINT32_MAX - count / 2;
+
+    int drops = 0, cancels = 0;
+
+    for (int i = 0; i < count; ++i) {
+        std::string body = (i % 7 == 0 ? "drop " : "request ") + std::to_string(i) + std::string(i % 300, 'x');
+        uint32_t id = caller->send(*channel, i, body, TIMEOUT_USEC);
+
+        if (i % 11 == 0) {
+            channel->cancel(id);
+            caller->requests[id].cancelled = true;
+            ++cancels;
+        } else if (i % 7 == 0) {
+            ++drops;
+        }
+    }
+
+    caller->expected = count - cancels;
+
+    loop.start();
+
+    printf("%d requests. Responses: %d timeouts: %d cancelled: %d errors: %d bad: %d out of order: %s\n",
+        count, caller->responses, caller->timeouts, cancels, caller->errors, caller->bad, caller->out_of_order ? "Y" : "N");
+
+    bool passed = caller->bad == 0 && caller->out_of_order && caller->timeouts == drops &&
+        caller->responses == count - cancels - drops && caller->errors == caller->held && channel->in_flight() == 0;
+
+    printf("%s\n", passed ? "Passed" : "Failed");
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,379 @@
+/*
+* Plays a capture made with EventLoop::start_capture() back against
+* a server. Each captured connection is opened again at its original
+* time. Bytes the server read are sent and the loop waits for as many
+* bytes as the server wrote in response. Times are divided by speed.
+* Prints the response latency of each connection.
+*
+* Usage: replay capture_file host port [speed]
+*/
+#include <pompeii.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+
+const int REPLAY_SEND = 1;
+const int REPLAY_EXPECT = 2;
+
+//Give up on a connection when the server stays quiet this long
+const uint64_t STALL_USEC = 5000000;
+
+struct Step {
+    int type;
+    uint64_t usec; //Time of the first captured record
+    std::string bytes; //To send
+    size_t length; //Expected bytes
+};
+
+struct Connection {
+    uint32_t id;
+    uint64_t open_usec;
+    std::vector<Step> steps;
+
+    //Results
+    const char *status = "not started";
+    size_t bytes_sent = 0;
+    size_t bytes_received = 0;
+    std::vector<uint64_t> latencies;
+};
+
+uint64_t now_usec() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Player;
+
+struct ReplayClient : public pompeii::ClientEventHandler, public pompeii::TimerEventHandler {
+    Player &player;
+    Connection &conn;
+    pompeii::Client *client = NULL;
+    size_t step = 0;
+    uint64_t start_usec = 0; //When the connection was opened
+    uint64_t send_usec = 0; //When the last request started
+    int send_timer = -1;
+    int stall_timer = -1;
+    std::vector<char> read_buff;
+
+    ReplayClient(Player &p, Connection &c) : player(p), conn(c) {
+    }
+
+    std::shared_ptr<ReplayClient> self() {
+        return client->get_handler<ReplayClient>();
+    }
+
+    void next_step();
+    void finish(const char *status);
+
+    void on_server_connect(pompeii::Client& c);
+    void on_server_connect_failed(pompeii::Client& c);
+    void on_server_disconnect(pompeii::Client& c);
+    void on_write_completed(pompeii::Client& c);
+    void on_read_completed(pompeii::Client& c);
+    void on_timer(pompeii::EventLoop& loop, int timer_id);
+};
+
+struct Player : public pompeii::TimerEventHandler {
+    pompeii::EventLoop &loop;
+    std::vector<Connection> connections; //In order of open time
+    std::string host;
+    int port;
+    double speed;
+    size_t next_open = 0;
+    int running = 0;
+    uint64_t start_usec = 0;
+    int open_timer = -1;
+    std::shared_ptr<Player> self;
+
+    Player(pompeii::EventLoop &l) : loop(l) {
+    }
+
+    uint64_t due(uint64_t captured_usec, uint64_t base_usec, uint64_t since_usec) {
+        return since_usec + (uint64_t) ((captured_usec - base_usec) / speed);
+    }
+
+    //Opens the connections that are due
+    void open_connections() {
+        uint64_t now = now_usec();
+
+        while (next_open < connections.size()) {
+            Connection &conn = connections[next_open];
+            uint64_t when = due(conn.open_usec, connections[0].open_usec, start_usec);
+
+            if (when > now) {
+                if (open_timer < 0) {
+                    open_timer = loop.add_timer(when - now, self);
+                }
+
+                return;
+            }
+
+            auto rc = std::make_shared<ReplayClient>(*this, conn);
+
+            if (loop.add_client(host.c_str(), port, rc, 5000) == NULL) {
+                if (running > 0) {
+                    //All client slots are taken. Try again when one frees up.
+                    return;
+                }
+
+                conn.status = "failed";
+                ++next_open;
+
+                continue;
+            }
+
+            conn.status = "connecting";
+
+            ++running;
+            ++next_open;
+        }
+
+        if (running == 0) {
+            loop.end();
+        }
+    }
+
+    void on_timer(pompeii::EventLoop& l, int timer_id) {
+        open_timer = -1;
+
+        open_connections();
+    }
+
+    void on_connection_done() {
+        --running;
+
+        //The loop still holds the slot of the client. Open the next
+        //connection once the callback has returned.
+        if (open_timer < 0) {
+            open_timer = loop.add_timer(0, self);
+        }
+    }
+
+    void report() {
+        std::vector<uint64_t> all;
+
+        printf("%8s %-12s %8s %12s %12s %10s %10s %10s\n",
+            "conn", "status", "requests", "sent", "received", "avg_us", "p50_us", "max_us");
+
+        for (auto& conn : connections) {
+            auto& l = conn.latencies;
+            uint64_t sum = 0;
+
+            for (uint64_t v : l) {
+                sum += v;
+            }
+
+            all.insert(all.end(), l.begin(), l.end());
+            std::sort(l.begin(), l.end());
+
+            printf("%8u %-12s %8zu %12zu %12zu %10lu %10lu %10lu\n",
+                conn.id, conn.status, l.size(), conn.bytes_sent, conn.bytes_received,
+                l.empty() ? 0 : sum / l.size(),
+                l.empty() ? 0 : l[l.size() / 2],
+                l.empty() ? 0 : l.back());
+        }
+
+        std::sort(all.begin(), all.end());
+
+        if (!all.empty()) {
+            printf("Total requests: %zu p50: %luus p99: %luus max: %luus\n",
+                all.size(), all[all.size() / 2], all[all.size() * 99 / 100], all.back());
+        }
+    }
+};
+
+void ReplayClient::on_server_connect(pompeii::Client& c) {
+    client = &c;
+    start_usec = now_usec();
+    conn.status = "running";
+
+    next_step();
+}
+
+void ReplayClient::on_server_connect_failed(pompeii::Client& c) {
+    conn.status = "failed";
+
+    player.on_connection_done();
+}
+
+void ReplayClient::on_server_disconnect(pompeii::Client& c) {
+    player.loop.cancel_timer(send_timer);
+    player.loop.cancel_timer(stall_timer);
+
+    if (step < conn.steps.size() && conn.status == std::string("running")) {
+        conn.status = "closed early";
+    }
+
+    client = NULL;
+
+    player.on_connection_done();
+}
+
+void ReplayClient::finish(const char *status) {
+    conn.status = status;
+
+    player.loop.disconnect_client(*client);
+}
+
+void ReplayClient::next_step() {
+    if (step == conn.steps.size()) {
+        finish("ok");
+
+        return;
+    }
+
+    Step &s = conn.steps[step];
+
+    if (s.type == REPLAY_SEND) {
+        uint64_t when = player.due(s.usec, conn.open_usec, start_usec);
+        uint64_t now = now_usec();
+
+        if (when > now) {
+            //Keep the think time of the original client
+            send_timer = player.loop.add_timer(when - now, self());
+
+            if (send_timer >= 0) {
+                return;
+            }
+        }
+
+        send_usec = now;
+        client->schedule_write(s.bytes.data(), s.bytes.size());
+    } else {
+        read_buff.resize(s.length);
+        stall_timer = player.loop.add_timer(STALL_USEC, self());
+        client->schedule_read(read_buff.data(), read_buff.size());
+    }
+}
+
+void ReplayClient::on_timer(pompeii::EventLoop& loop, int timer_id) {
+    if (timer_id == stall_timer) {
+        stall_timer = -1;
+
+        finish("stalled");
+    } else if (timer_id == send_timer) {
+        send_timer = -1;
+
+        send_usec = now_usec();
+        client->schedule_write(conn.steps[step].bytes.data(), conn.steps[step].bytes.size());
+    }
+}
+
+void ReplayClient::on_write_completed(pompeii::Client& c) {
+    conn.bytes_sent += conn.steps[step].bytes.size();
+    ++step;
+
+    next_step();
+}
+
+void ReplayClient::on_read_completed(pompeii::Client& c) {
+    player.loop.cancel_timer(stall_timer);
+    stall_timer = -1;
+
+    conn.bytes_received += conn.steps[step].length;
+
+    if (step > 0 && conn.steps[step - 1].type == REPLAY_SEND) {
+        //Time from the start of the request to the end of the response
+        conn.latencies.push_back(now_usec() - send_usec);
+    }
+
+    ++step;
+
+    next_step();
+}
+
+//Turns the records of a capture into a script per connection
+bool load_capture(const char *path, std::vector<Connection> &connections) {
+    FILE *in = pompeii::open_capture(path);
+
+    if (in == NULL) {
+        return false;
+    }
+
+    std::map<uint32_t, size_t> index;
+    pompeii::CaptureRecord r;
+    std::vector<char> payload;
+
+    while (pompeii::read_capture_record(in, r, payload)) {
+        if (r.type == pompeii::CAPTURE_OPEN) {
+            index[r.connection_id] = connections.size();
+            connections.push_back(Connection());
+            connections.back().id = r.connection_id;
+            connections.back().open_usec = r.usec;
+
+            continue;
+        }
+
+        auto it = index.find(r.connection_id);
+
+        if (it == index.end() || r.type == pompeii::CAPTURE_CLOSE) {
+            continue;
+        }
+
+        auto& steps = connections[it->second].steps;
+        int type = r.type == pompeii::CAPTURE_READ ? REPLAY_SEND : REPLAY_EXPECT;
+
+        if (steps.empty() || steps.back().type != type) {
+            steps.push_back(Step());
+            steps.back().type = type;
+            steps.back().usec = r.usec;
+            steps.back().length = 0;
+        }
+
+        if (type == REPLAY_SEND) {
+            steps.back().bytes.append(payload.data(), payload.size());
+        } else {
+            steps.back().length += r.length;
+        }
+    }
+
+    fclose(in);
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        printf("Usage: %s capture_file host port [speed]\n", argv[0]);
+
+        return 1;
+    }
+
+    pompeii::EventLoop loop;
+    auto player = std::make_shared<Player>(loop);
+
+    player->self = player;
+    player->host = argv[2];
+    player->port = atoi(argv[3]);
+    player->speed = argc > 4 ? atof(argv[4]) : 1.0;
+
+    if (player->speed <= 0) {
+        player->speed = 1.0;
+    }
+
+    if (!load_capture(argv[1], player->connections)) {
+        printf("Not a capture file: %s\n", argv[1]);
+
+        return 1;
+    }
+
+    if (player->connections.empty()) {
+        printf("No connections in the capture.\n");
+
+        return 0;
+    }
+
+    printf("Replaying %zu connections at %.2fx. Up to %d at a time.\n",
+        player->connections.size(), player->speed, MAX_CLIENTS);
+
+    player->start_usec = now_usec();
+    player->open_connections();
+
+    loop.start();
+
+    player->report();
+    player->self.reset();
+}